@@ -79,7 +79,15 @@
 #include <sys/stat.h>
 #include <dirent.h>
 
-#include "pcre.h"
+#ifdef USE_PCRE2
+#   define PCRE2_CODE_UNIT_WIDTH 8
+#   include <pcre2.h>
+#   define PCRE_CASELESS PCRE2_CASELESS
+#   define PCRE_MULTILINE PCRE2_MULTILINE
+#   define PCRE_DOTALL PCRE2_DOTALL
+#else
+#   include "pcre.h"
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <locale.h>
@@ -138,6 +146,11 @@ int alphasort(const void *a, const void *b);
 # define O_NOATIME 0
 #endif
 
+/* the decompressors started by unzip_open() get none of our files */
+#if !defined O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
+
 
 #define USE_READ
 
@@ -145,7 +158,7 @@ int alphasort(const void *a, const void *b);
 #   define FISGOOD(x) (x!=-1)
 #   define FHANDLE int
 #   define FREAD(fid,buf,size) read(fid,buf,size)
-#   define FOPEN(name) open(name,O_RDONLY)
+#   define FOPEN(name) open(name,O_RDONLY|O_CLOEXEC)
 #   define FCLOSE(fid) close(fid)
 #   define FSTDIN_HANDLE 0
 #   define FSTDOUT_HANDLE 1
@@ -160,6 +173,91 @@ int alphasort(const void *a, const void *b);
 #endif
 
 #define BUFFER_SIZE 64*1024
+/* max block handed to a single find() call, pcre wants int lengths */
+#define SCAN_MAX (1024*1024*1024)
+/* up to this far back the regex rescans from the last line start */
+#define REQ_GAP 256
+/* data checked for binary right before it is searched, while it is in the cache */
+#define TEXT_CHUNK (256*1024)
+/* -U: the tail of the data read so far is searched again with what comes after it */
+#define MULTILINE_WINDOW (1024*1024)
+/* --patterns-from: regex bytes per alternation, PCRE limits the compiled size */
+#define PATTERNS_CHUNK (4*1024)
+
+/* --binary= */
+#define BINARY_MATCHES 0 /* "Binary file ... matches" instead of the lines */
+#define BINARY_TEXT 1
+#define BINARY_SKIP 2
+#define BINARY_WITHOUT_MATCH 3
+
+/* vector kernels for literal search, picked at startup by CPUID */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(NO_SIMD)
+#   define USE_SIMD
+#   include <immintrin.h>
+#endif
+
+#if defined(USE_READ) && !defined(WINDOWS)
+#   define USE_MMAP
+#   include <sys/mman.h>
+#endif
+
+/* regular files at least that big are mapped instead of read */
+#define MMAP_THRESHOLD (BUFFER_SIZE)
+
+/* regular files up to that size are loaded with a single read() if they
+   are not mapped, the default of --whole-size */
+#ifndef SMALL_FILE_SIZE
+#   define SMALL_FILE_SIZE 1048576
+#endif
+
+/*
+ * io_uring with direct descriptors. The build needs the headers of
+ * linux 5.19+ (IORING_FILE_INDEX_ALLOC tells them), the kernel needs
+ * 5.15+ to open into a direct descriptor slot. An older kernel is found
+ * out at run time, see uring_load().
+ */
+#if defined(__linux__) && defined(USE_READ) && !defined(NO_URING) && defined(__has_include)
+#   if __has_include(<linux/io_uring.h>)
+#       include <linux/io_uring.h>
+#       include <sys/syscall.h>
+#       ifdef IORING_FILE_INDEX_ALLOC
+#           define USE_URING
+#       endif
+#   endif
+#endif
+
+#if defined(__linux__) && defined(USE_READ)
+#   define USE_GETDENTS
+#   include <stdint.h>
+#   include <sys/syscall.h>
+#endif
+
+/* --passthru copies files to stdout inside the kernel */
+#if defined(__linux__) && defined(USE_READ)
+#   define USE_SENDFILE
+#   include <sys/sendfile.h>
+#endif
+
+/* gzip files are inflated with zlib if there is one, the other compressed
+   files are piped through an external decompressor */
+#if defined(USE_READ) && !defined(WINDOWS)
+#   define USE_ZIP
+#   include <sys/wait.h>
+#   include <sys/ioctl.h>
+#   include <poll.h>
+#   ifndef NO_ZLIB
+#       define USE_ZLIB
+#       include <zlib.h>
+#   endif
+#endif
+
+/* buffer for getdents64() */
+#define DENTS_SIZE (64*1024)
+
+/* files opened and read by a single io_uring submission */
+#define URING_WINDOW 64
+/* files bigger than that are read the usual way */
+#define URING_READ_SIZE (BUFFER_SIZE)
 
 #ifdef DEBUG
 static void* (*x_malloc)(size_t) = malloc;
@@ -180,6 +278,7 @@ long malloced=0;
 #define true !false
 #define bool int
 #define OFFSETS_SIZE 120
+#define ERR_PATTERN_SIZE 256 /* bytes of a pattern echoed in an error */
 #define numberof(x) (sizeof(x)/sizeof((x)[0]))
 #define MATCH   0
 #define NOMATCH 1
@@ -196,19 +295,78 @@ typedef struct{
     size_t start;
 }buf_t;
 
+typedef struct{
+    const char *ptr; /* line start, points into copy.buf or into the mapped file */
+    long len;
+    buf_t copy;
+}line_t;
 
 
 typedef struct {
     int start;
     int len;
+    int id; /* --patterns-from: the pattern that matched */
 }match_t;
 
+/* bytes a search can skip to, see skip_to() */
+typedef struct{
+    unsigned char first[256];
+    unsigned char lo[16]; /* first bytes by low nibble, a bit per high nibble */
+    unsigned char hi[16];
+    int simd; /* few enough bytes for the vector scan */
+}skipset_t;
+
+typedef struct ac ac_t;
+typedef struct dfa dfa_t;
+
+/* match state of a pattern, each search gets its own from re_ctx_new() */
+typedef struct re_ctx{
+    dfa_t *dfa; /* NULL if the pattern needs PCRE, its state cache grows while searching */
+    struct re_ctx **subs; /* state of each of re->subs */
+    int nsubs;
+    int err; /* the error re_exec() gave up with */
+    const char *lines; /* block_find() goes line by line in lines..lines_end */
+    const char *lines_end;
+#ifdef USE_PCRE2
+    pcre2_match_data *md;
+    pcre2_match_context *mctx;
+    pcre2_jit_stack *stack;
+#else
+    int offsets[OFFSETS_SIZE];
+    pcre_extra pe; /* re->pe asking for the mark */
+    unsigned char *mark;
+#endif
+}re_ctx_t;
+
 typedef struct re{
+#ifdef USE_PCRE2
+    pcre2_code *re;
+    int jit; /* pcre2_jit_compile() went fine */
+#else
     pcre *re;
     pcre_extra *pe;
+#ifdef PCRE_STUDY_JIT_COMPILE
+    pcre_jit_stack *stack;
+#endif
+#endif
+    int options; /* compile() options, re_ctx_new() builds the DFA with them */
+    ac_t *ac; /* set of literals from --patterns-from */
+    struct re *subs; /* the regexes of the set, an alternation per chunk */
+    int nsubs;
+    int marks; /* the alternatives of the set end in (*MARK:id) */
+    char *req; /* literal every match contains, NULL if none */
+    int reqlen;
+    int req_caseless;
+    int req_rare[2];
+    int literal; /* -Q, the pattern is a string whatever it holds */
+    int word; /* -w, a match starts on a word boundary */
+    int caseless;
+    int rare[2]; /* bytes of the pattern the string search anchors on */
     int plen;
     char *pattern;
-    int (*findall)(struct re *re,const char *str,long len,match_t *matches, int matches_len);
+    int (*findall)(struct re *re,re_ctx_t *ctx,const char *str,long len,match_t *matches, int matches_len);
+    /* first match in a block of lines, NULL if the pattern can be checked line by line only */
+    int (*find)(struct re *re,re_ctx_t *ctx,const char *str,long len,match_t *match);
 }re_t;
 
 typedef struct ext{
@@ -264,12 +422,20 @@ struct {
     char *output; /*  --output=expr  Output the evaluation of expr for each line (turns off text highlighting) */
     re_t match; /* --match PATTERN       Specify PATTERN explicitly. */
     char *match_pattern;
+    char *patterns_from; /* --patterns-from=FILE Search for the patterns in FILE, one per line */
     long m; /* -m, --max-count=NUM   Stop searching in each file after NUM matches */
     int one; /*  -1 Stop searching after one match of any kind */
     int H; /* -H, --with-filename   Print the filename for each match */
     int h; /* -h, --no-filename     Suppress the prefixing filename on output */
     int c; /* -c, --count   Show number of lines matching per file */
+    int count_matches; /* --count-matches Show number of matches per file */
     int column; /* --column Show the column number of the first match */
+    int show_pattern; /* --show-pattern Show the line of the --patterns-from file that matched */
+    int line_number; /* --[no-]line-number Print the line number of each line (default: on) */
+    int binary; /* --binary=skip|text|without-match What to do with binary files */
+    int binary_utf8; /* --binary=utf8 In a UTF-8 locale invalid UTF-8 is binary too */
+    int multiline; /* -U, --multiline Let matches span lines */
+    int multiline_dotall; /* --multiline-dotall With -U, . matches newlines too */
     int A; /* -A NUM, --after-context=NUM Print NUM lines of trailing context after matching lines. */
     int B; /* -B NUM, --before-context=NUM Print NUM lines of leading context before matching lines. */
     int C; /*  -C [NUM], --context[=NUM]  Print NUM lines (default 2) of output context. */
@@ -304,6 +470,12 @@ struct {
     int u; /* -u, --unrestricted    All files and directories searched */
     int r; /* -r, -R, --recurse     Recurse into subdirectories (ack's default behavior) */
     int follow; /*   --[no]follow          Follow symlinks.  Default is off.*/
+    int mmap; /* --[no]mmap Map big regular files into memory instead of reading them */
+    int uring; /* --[no]uring Open and read small files in batches with io_uring */
+    int prefetch; /* --prefetch=NUM Read NUM files ahead of the one being searched */
+    int whole_size; /* --whole-size=NUM Read regular files up to NUM bytes with a single read() */
+    int z; /* -z, --search-zip Search the contents of compressed files */
+    int archives; /* --search-archives Search the members of tar and zip archives */
     int env; /* --(no)env */
     int help;
     int help_types;
@@ -317,6 +489,7 @@ struct {
 
     /* switches */
     int show_filename;
+    int show_lineno; /* line numbers go with the file names only */
     char *line_end;
     int show_total;
     int recursive;
@@ -334,23 +507,34 @@ struct {
 }opt;
 
 
-typedef struct{
+typedef struct file{
     FHANDLE f;
-    char *fullname;
+    long (*read)(struct file *file,char *buf,long size); /* reads f when set */
+    char *fullname; /* built by file_fullname() when needed */
     char *name;
     int namelen;
+    char *path; /* what to open, relative to dirfd */
+    int dirfd;
+    const char *dirname; /* directory part of fullname, NULL if none */
+    int dirlen;
     long nmatches;
     long line; /* current line */
     bitfiels_t *filetypes;
     int is_binary;
     int type_processed;
+    int whole; /* buf holds the whole file, there is nothing to read */
+    int mapped; /* buf is a read-only mapping of the file */
     buf_t buf;
+    buf_t rbuf; /* read buffer saved while buf holds the whole file */
+    FHANDLE zf; /* the compressed file while f reads the decompressor */
+    int zpid; /* the decompressor, -1 once it is waited for */
 }file_t;
 
 struct {
     long files_matched;
+    long files_listed; /* -L, files without a match */
     long total_matches;
-    buf_t *history;
+    line_t *history;
     int hused;
     int hprint;
     bitfiels_t *filetypes;
@@ -361,10 +545,14 @@ struct {
     filetype_t *ft_make;
     filetype_t *ft_ruby;
     filetype_t *ft_binary;
-    int offsets[OFFSETS_SIZE];
+    int by_content; /* a wanted type can be found in the first line of a file, not only in its name */
     int nmatches;
     match_t matches[OFFSETS_SIZE];
     file_t file;
+    buf_t fullname;
+    long (*analize)(file_t *file,re_ctx_t *ctx); /* the search loop for the options, see analize_select() */
+    re_ctx_t *ctx; /* match state of opt.match for the searches started here */
+    re_ctx_t *G_ctx; /* of opt.G */
 }vars;
 
 
@@ -566,17 +754,47 @@ struct{
 
 };
 
-int re_findall(re_t *re,const char *str,long len,match_t *matches, int matches_len);
-int str_findall(re_t *re,const char *str,long len,match_t *matches, int matches_len);
-int str_casefindall(re_t *re,const char *str,long len,match_t *matches, int matches_len);
+int re_findall(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *matches, int matches_len);
+int str_findall(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *matches, int matches_len);
+int str_casefindall(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *matches, int matches_len);
+int re_find(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match);
+int str_find(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match);
+int str_casefind(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match);
+int word_findall(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *matches, int matches_len);
+int word_find(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match);
+int lit_compile(re_t *re,int options);
+int set_findall(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *matches, int matches_len);
+int set_find(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match);
+int set_exec(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match,int (*exec)(re_t*,re_ctx_t*,const char*,long,match_t*));
+void re_ctx_free(re_ctx_t *ctx);
+int re_ctx_subs(re_t *re,re_ctx_t *ctx);
+void re_ctx_subs_free(re_ctx_t *ctx);
+int multiline_find(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match);
+int block_find(re_ctx_t *ctx,const char *str,long len,match_t *match);
+void re_warn(re_ctx_t *ctx);
+long line_matches(re_ctx_t *ctx,const char *str,long len);
+long invert_file(file_t *file,re_ctx_t *ctx);
+long multiline_file(file_t *file,re_ctx_t *ctx);
+int text_check(file_t *file);
+int text_binary(file_t *file);
+int is_block_safe(char *str);
 int is_regexp(char * str, int len);
 void get_filetypes(file_t *file);
+int name_filetypes(file_t *file);
 int _ends_with(const char *name,int nsize,const char *ext,int esize);
 int is_searchable(file_t *);
 char *_strnstr1(const char *s, const char *f, int sl);
 char *_strnstr2(const char *s, int sl, const char *f, int fl);
 char *_strnstr3(const char *s, int sl, const char *f, int fl);
-char *_strncasestr(const char *s, int sl, const char *f, int fl);
+char *lit_search(const char *s, int sl, const char *f, int fl, const int *rare);
+char *lit_casesearch(const char *s, int sl, const char *f, int fl, const int *rare);
+void lit_rare(const char *f, int fl, int caseless, int *rare);
+void ac_free(ac_t *ac);
+void skipset_init(skipset_t *ss);
+long skip_to(const skipset_t *ss,const unsigned char *p,long i,long len);
+dfa_t *dfa_compile(const char *pattern,int options);
+int dfa_exec(dfa_t *d,const char *str,long len,match_t *match);
+void dfa_free(dfa_t *d);
 
 #define strnstr _strnstr3
 
@@ -806,11 +1024,18 @@ void bf_free(bitfiels_t *b) {
 /* bit field */
 /* ========================================================================= */
 
-int read_file(buf_t *line,FHANDLE f, long size) {
+int read_file(file_t *file, long size) {
     int res;
     int _free;
     char *tmp;
+    buf_t *line;
 
+    if (file->whole){
+        /* the whole file is already there */
+        return 0;
+    }
+
+    line = &file->buf;
     _free =  line->allocated - line->used;
 
     if (!_free){
@@ -832,7 +1057,11 @@ int read_file(buf_t *line,FHANDLE f, long size) {
         size = line->allocated - (line->start+line->used);
     }
 
-    res = FREAD(f,&line->buf[line->start+line->used],size);
+    if (file->read){
+        res = file->read(file,&line->buf[line->start+line->used],size);
+    }else{
+        res = FREAD(file->f,&line->buf[line->start+line->used],size);
+    }
     if (res>0){
         line->used+=res;
     }
@@ -858,12 +1087,13 @@ const char* _strnchr(const char *str, int len, int ch) {
 
 #define _strnchr(str,len,c) memchr(str,c,len)
 
-int get_line(buf_t *line, file_t *file) {
+int get_line(line_t *line, file_t *file) {
     int start;
     int len;
     const char *ptr;
     char *tmp;
     int res;
+    buf_t *copy;
 
     ptr = NULL;
 
@@ -872,7 +1102,7 @@ int get_line(buf_t *line, file_t *file) {
         ptr = _strnchr(&file->buf.buf[file->buf.start+start],file->buf.used-start,0x0a);
         if (!ptr){
             start = file->buf.used;
-            res = read_file(&file->buf,file->f,BUFFER_SIZE);
+            res = read_file(file,BUFFER_SIZE);
             if (res<=0){
                 break;
             }
@@ -885,87 +1115,501 @@ int get_line(buf_t *line, file_t *file) {
         len = file->buf.used;
     }
 
-    if (line->allocated < len){
-        tmp = realloc(line->buf,len*2);
-        if (!tmp){
-            fprintf(stderr,"%s: "__FILE__":"STR(__LINE__)" OOM\n",opt.self_name);
-            return 0;
+    if (file->whole){
+        /* the data stays valid till the file is closed, no need to copy */
+        line->ptr = &file->buf.buf[file->buf.start];
+    }else{
+        copy = &line->copy;
+        if (copy->allocated < len){
+            tmp = realloc(copy->buf,len*2);
+            if (!tmp){
+                fprintf(stderr,"%s: "__FILE__":"STR(__LINE__)" OOM\n",opt.self_name);
+                return 0;
+            }
+            copy->allocated = len*2;
+            copy->used = 0;
+            copy->start = 0;
+            copy->buf = tmp;
         }
-        line->allocated = len*2;
-        line->used = 0;
-        line->start = 0;
-        line->buf = tmp;
+        if (len){
+            memcpy(copy->buf,&file->buf.buf[file->buf.start],len);
+        }
+        copy->used = len;
+        line->ptr = copy->buf;
     }
     if (len){
-       memcpy(line->buf,&file->buf.buf[file->buf.start],len);
        file->buf.used -= len;
        file->buf.start += len;
        if (!file->buf.used){
           file->buf.start = 0;
        }
     }
-    line->used = len;
+    line->len = len;
     return len;
 }
 
+/*
+ * The longest literal every match of the pattern has to contain. Only
+ * the top level is looked at and anything unclear ends the current run,
+ * so the result may be shorter than it could be but is never wrong.
+ * Returns the length, the literal is put into lit.
+ */
+int required_literal(const char *p,char *lit) {
+    char *run;
+    int n;
+    int best;
+    int depth;
+
+    run = lit+strlen(p)+1;
+    n = 0;
+    best = 0;
+    depth = 0;
+
+#define FLUSH() do{ if (n>best){ memcpy(lit,run,n); best = n; } n = 0; }while(0)
+    while(*p){
+        if (*p == '(' && p[1] == '?' && !strchr(":=!<",p[2])){
+            /* inline options may change what follows */
+            return 0;
+        }
+        if (depth){
+            if (*p == '\\' && p[1]){
+                p++;
+            }else if (*p == '('){
+                depth++;
+            }else if (*p == ')'){
+                depth--;
+            }
+            p++;
+            continue;
+        }
+        switch(*p){
+        case '|':
+            return 0;
+        case ')':
+            return 0;
+        case '\\':
+            if (p[1] == 'Q'){
+                for(p += 2;*p && !(*p == '\\' && p[1] == 'E');p++){
+                    run[n++] = *p;
+                }
+                p += *p? 2:0;
+            }else if (!p[1]){
+                return 0;
+            }else if (strchr("xkcgoNpP0123456789",p[1])){
+                /* escapes with an argument: \x41, \0101, \k<name>, \p{..} ... */
+                return 0;
+            }else if (isalnum((unsigned char)p[1])){
+                /* classes, assertions */
+                FLUSH();
+                p += 2;
+            }else{
+                run[n++] = p[1];
+                p += 2;
+            }
+            break;
+        case '(':
+            FLUSH();
+            depth = 1;
+            p++;
+            break;
+        case '[':
+            FLUSH();
+            p++;
+            if (*p == '^'){
+                p++;
+            }
+            if (*p == ']'){
+                p++;
+            }
+            while(*p && *p != ']'){
+                if (*p == '[' && p[1] == ':' && strstr(p,":]")){
+                    p = strstr(p,":]")+1;
+                }else if (*p == '\\' && p[1]){
+                    p++;
+                }
+                p++;
+            }
+            p += *p? 1:0;
+            break;
+        case '*':
+        case '?':
+        case '{':
+            /* the char before is optional */
+            if (n){
+                n--;
+            }
+            FLUSH();
+            if (*p == '{' && strchr(p,'}')){
+                p = strchr(p,'}');
+            }
+            p++;
+            break;
+        case '+':
+        case '.':
+        case '^':
+        case '$':
+            FLUSH();
+            p++;
+            break;
+        default:
+            run[n++] = *p++;
+        }
+    }
+    FLUSH();
+#undef FLUSH
+    return best;
+}
+
+/* regex searches look for the required literal first */
+void re_prefilter(re_t *re,char *pattern,int options) {
+    re->req = malloc(2*strlen(pattern)+2);
+    if (!re->req){
+        return;
+    }
+    re->reqlen = required_literal(pattern,re->req);
+    if (re->reqlen<2){
+        free(re->req);
+        re->req = NULL;
+        return;
+    }
+    re->req_caseless = options & PCRE_CASELESS;
+    lit_rare(re->req,re->reqlen,re->req_caseless,re->req_rare);
+}
+
+const char *re_req_search(re_t *re,const char *str,long len) {
+    if (re->req_caseless){
+        return lit_casesearch(str,len,re->req,re->reqlen,re->req_rare);
+    }
+    return lit_search(str,len,re->req,re->reqlen,re->req_rare);
+}
+
+/* strings need no PCRE, -w checks the byte before a hit instead of \b */
+int lit_compile(re_t *re,int options) {
+    re->caseless = options & PCRE_CASELESS;
+    lit_rare(re->pattern,re->plen,re->caseless,re->rare);
+    if (re->word){
+        re->findall = word_findall;
+        re->find = word_find;
+    }else if (re->caseless){
+        re->findall = str_casefindall;
+        re->find = str_casefind;
+    }else{
+        re->findall = str_findall;
+        re->find = str_find;
+    }
+    return 1;
+}
+
+#ifdef USE_PCRE2
+int compile(re_t *re,char *pattern,int options) {
+    PCRE2_UCHAR error[256];
+    int errcode;
+    PCRE2_SIZE erroffset;
+
+    re->plen = strlen(pattern);
+    re->pattern = pattern;
+    re->options = options;
+    if (re->literal){
+        return lit_compile(re,options);
+    }
+    re->re = pcre2_compile((PCRE2_SPTR)pattern,PCRE2_ZERO_TERMINATED,options,&errcode,&erroffset,NULL);
+    if (!re->re){
+        pcre2_get_error_message(errcode,error,sizeof(error));
+        fprintf(stderr,"%s: Failed to compile regex '%.*s%s':%s\n",opt.self_name,ERR_PATTERN_SIZE,pattern,re->plen>ERR_PATTERN_SIZE? "...":"",(char*)error);
+        return 0;
+    }
+
+    if (is_regexp(pattern,re->plen)){
+       re->findall = re_findall;
+       re->find = is_block_safe(pattern)? re_find:NULL;
+       re_prefilter(re,pattern,options);
+       re->jit = 0 == pcre2_jit_compile(re->re,PCRE2_JIT_COMPLETE);
+    }else{
+       return lit_compile(re,options);
+    }
+    return 1;
+}
+
+void re_free(re_t *re) {
+    int i;
+
+    ac_free(re->ac);
+    re->ac = NULL;
+    for(i=0;i<re->nsubs;i++){
+        re_free(&re->subs[i]);
+    }
+    free(re->subs);
+    re->subs = NULL;
+    re->nsubs = 0;
+    free(re->req);
+    re->req = NULL;
+    pcre2_code_free(re->re);
+    re->re = NULL;
+}
+
+/* match state for one search with re, NULL if out of memory */
+re_ctx_t *re_ctx_new(re_t *re) {
+    re_ctx_t *ctx;
+
+    ctx = calloc(1,sizeof(re_ctx_t));
+    if (ctx && !re_ctx_subs(re,ctx)){
+        re_ctx_free(ctx);
+        return NULL;
+    }
+    if (!ctx || !re->re){
+        return ctx;
+    }
+    if (!(ctx->md = pcre2_match_data_create_from_pattern(re->re,NULL))){
+        free(ctx);
+        return NULL;
+    }
+    if (re->findall == re_findall){
+        ctx->dfa = dfa_compile(re->pattern,re->options);
+    }
+    if (re->jit){
+        /* the default 32K JIT stack is too small for some patterns */
+        ctx->mctx = pcre2_match_context_create(NULL);
+        ctx->stack = pcre2_jit_stack_create(32*1024,1024*1024,NULL);
+        if (ctx->mctx && ctx->stack){
+            pcre2_jit_stack_assign(ctx->mctx,NULL,ctx->stack);
+        }
+    }
+    return ctx;
+}
+
+void re_ctx_free(re_ctx_t *ctx) {
+    if (ctx){
+        re_ctx_subs_free(ctx);
+        dfa_free(ctx->dfa);
+        pcre2_match_data_free(ctx->md);
+        pcre2_match_context_free(ctx->mctx);
+        pcre2_jit_stack_free(ctx->stack);
+        free(ctx);
+    }
+}
+
+/* first match in str, 0 if none, -1 if PCRE gave up (match or depth limit) */
+int re_exec(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match) {
+    PCRE2_SIZE *ov;
+    PCRE2_SPTR mark;
+    int res;
+
+    if (ctx->dfa){
+        return dfa_exec(ctx->dfa,str,len,match);
+    }
+    res = PCRE2_ERROR_JIT_STACKLIMIT;
+    if (re->jit){
+        res = pcre2_jit_match(re->re,(PCRE2_SPTR)str,len,0,PCRE2_NOTEMPTY,ctx->md,ctx->mctx);
+    }
+    if (res == PCRE2_ERROR_JIT_STACKLIMIT){
+        /* the interpreter backtracks on the heap, past what the JIT stack holds */
+        res = pcre2_match(re->re,(PCRE2_SPTR)str,len,0,PCRE2_NOTEMPTY|PCRE2_NO_JIT,ctx->md,NULL);
+    }
+    if (res == PCRE2_ERROR_NOMATCH){
+        return 0;
+    }
+    if (res<0){
+        ctx->err = res;
+        return -1;
+    }
+    ov = pcre2_get_ovector_pointer(ctx->md);
+    match->start = ov[0];
+    match->len = ov[1]-ov[0];
+    mark = re->marks? pcre2_get_mark(ctx->md):NULL;
+    match->id = mark? atoi((const char*)mark):0;
+    return 1;
+}
+
+/* a line PCRE gave up on is taken as not matching, the first one is reported */
+void re_warn(re_ctx_t *ctx) {
+    static int warned;
+    PCRE2_UCHAR error[256];
+
+    if (!warned++){
+        pcre2_get_error_message(ctx->err,error,sizeof(error));
+        fprintf(stderr,"%s: Some lines were not searched: %s\n",opt.self_name,(char*)error);
+    }
+}
+#else
 int compile(re_t *re,char *pattern,int options) {
     const char *error;
     int erroffset;
 
+    re->plen = strlen(pattern);
+    re->pattern = pattern;
+    re->options = options;
+    if (re->literal){
+        return lit_compile(re,options);
+    }
     re->re  =  pcre_compile ((char *) pattern, options, &error, &erroffset, NULL);
     if (!re->re){
-        fprintf(stderr,"%s: Failed to compile regex '%s':%s\n",opt.self_name,pattern,error);
+        fprintf(stderr,"%s: Failed to compile regex '%.*s%s':%s\n",opt.self_name,ERR_PATTERN_SIZE,pattern,re->plen>ERR_PATTERN_SIZE? "...":"",error);
         return 0;
     }
 
-    re->plen = strlen(pattern);
-    re->pattern = pattern;
     if (is_regexp(pattern,re->plen)){
        re->findall = re_findall;
+       re->find = is_block_safe(pattern)? re_find:NULL;
+#ifdef PCRE_STUDY_JIT_COMPILE
+       re->pe = pcre_study(re->re,PCRE_STUDY_JIT_COMPILE,&error);
+       if (re->pe && (re->stack = pcre_jit_stack_alloc(32*1024,1024*1024))){
+           /* the default 32K JIT stack is too small for some patterns */
+           pcre_assign_jit_stack(re->pe,NULL,re->stack);
+       }
+#else
        re->pe = pcre_study(re->re,0,&error);
+#endif
+       re_prefilter(re,pattern,options);
     }else{
-       if (options & PCRE_CASELESS){
-          re->findall = str_casefindall;
-       }else{
-          re->findall = str_findall;
-       }
+       return lit_compile(re,options);
+    }
+    return 1;
+}
+
+void re_free(re_t *re) {
+    int i;
+
+    ac_free(re->ac);
+    re->ac = NULL;
+    for(i=0;i<re->nsubs;i++){
+        re_free(&re->subs[i]);
+    }
+    free(re->subs);
+    re->subs = NULL;
+    re->nsubs = 0;
+    free(re->req);
+    re->req = NULL;
+    if (re->pe){
+        pcre_free_study(re->pe);
+        re->pe = NULL;
+    }
+#ifdef PCRE_STUDY_JIT_COMPILE
+    if (re->stack){
+        pcre_jit_stack_free(re->stack);
+        re->stack = NULL;
+    }
+#endif
+    if (re->re){
+        pcre_free(re->re);
+        re->re = NULL;
     }
+}
+
+/* match state for one search with re, NULL if out of memory */
+re_ctx_t *re_ctx_new(re_t *re) {
+    re_ctx_t *ctx;
+
+    ctx = calloc(1,sizeof(re_ctx_t));
+    if (ctx && !re_ctx_subs(re,ctx)){
+        re_ctx_free(ctx);
+        return NULL;
+    }
+    if (ctx && re->findall == re_findall){
+        ctx->dfa = dfa_compile(re->pattern,re->options);
+    }
+    if (ctx && re->marks){
+        if (re->pe){
+            ctx->pe = *re->pe;
+        }
+        ctx->pe.flags |= PCRE_EXTRA_MARK;
+        ctx->pe.mark = &ctx->mark;
+    }
+    return ctx;
+}
+
+void re_ctx_free(re_ctx_t *ctx) {
+    if (ctx){
+        re_ctx_subs_free(ctx);
+        dfa_free(ctx->dfa);
+        free(ctx);
+    }
+}
+
+/* first match in str, 0 if none, -1 if PCRE gave up (match or recursion limit) */
+int re_exec(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match) {
+    int *ov;
+    int res;
+
+    if (ctx->dfa){
+        return dfa_exec(ctx->dfa,str,len,match);
+    }
+    ov = ctx->offsets;
+    res = pcre_exec(re->re,re->marks? &ctx->pe:re->pe,str,len,0,PCRE_NOTEMPTY,ov,OFFSETS_SIZE);
+    if (res == PCRE_ERROR_NOMATCH){
+        return 0;
+    }
+    if (res<0){
+        ctx->err = res;
+        return -1;
+    }
+    match->start = ov[0];
+    match->len = ov[1]-ov[0];
+    match->id = re->marks && ctx->mark? atoi((const char*)ctx->mark):0;
     return 1;
 }
 
+void re_warn(re_ctx_t *ctx) {
+    static int warned;
+
+    if (!warned++){
+        fprintf(stderr,"%s: Some lines were not searched, PCRE error %d\n",opt.self_name,ctx->err);
+    }
+}
+#endif
+
 
 
 
 
 
-int simple_match(re_t *re,const char *str, long len,match_t *matches, int matches_len) {
-    return re->findall(re,str,len,matches,matches_len);
+int simple_match(re_t *re,re_ctx_t *ctx,const char *str, long len,match_t *matches, int matches_len) {
+    return re->findall(re,ctx,str,len,matches,matches_len);
 }
 
 
-int re_findall(re_t *re,const char *str,long len,match_t *matches, int matches_len){
+int re_findall(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *matches, int matches_len){
     int nmatches = 0;
+    int res = 0;
+    match_t m;
     match_t *mptr;
 
     mptr = matches;
-    while(len && nmatches<matches_len && (0<pcre_exec(re->re,re->pe, (char *)str,len,0,0|PCRE_NOTEMPTY,vars.offsets,OFFSETS_SIZE))){
+    while(len && nmatches<matches_len && (res = re_exec(re,ctx,str,len,&m))>0){
         nmatches++;
         if (mptr){
-            mptr->start = vars.offsets[0];
-            mptr->len = vars.offsets[1]-vars.offsets[0];
+            *mptr = m;
             mptr++;
-            str+= vars.offsets[1];
-            len -= vars.offsets[1];
+            str+= m.start+m.len;
+            len -= m.start+m.len;
         }
     }
+    if (res<0){
+        re_warn(ctx);
+    }
+    return nmatches;
+}
+
+int str_findall(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *matches, int matches_len){
+    const char *r;
+    int nmatches = 0;
+
+    while(len && nmatches<matches_len && (r = lit_search(str,len,re->pattern,re->plen,re->rare))){
+        nmatches++;
+        matches->start = r-str;
+        matches->len = re->plen;
+        matches++;
+        r=r+re->plen;
+        len -= r-str;
+        str = r;
+    }
     return nmatches;
 }
 
-int str_findall(re_t *re,const char *str,long len,match_t *matches, int matches_len){
+int str_casefindall(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *matches, int matches_len){
     const char *r;
     int nmatches = 0;
 
-    while(len && nmatches<matches_len && (r = strnstr(str,len,re->pattern,re->plen))){
+    while(len && nmatches<matches_len && (r = lit_casesearch(str,len,re->pattern,re->plen,re->rare))){
         nmatches++;
         matches->start = r-str;
         matches->len = re->plen;
@@ -977,11 +1621,85 @@ int str_findall(re_t *re,const char *str,long len,match_t *matches, int matches_
     return nmatches;
 }
 
-int str_casefindall(re_t *re,const char *str,long len,match_t *matches, int matches_len){
+/* with a required literal the regex runs only on the lines containing it, -1 as re_exec() */
+int re_find(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match){
+    const char *r;
+    const char *bol;
+    const char *eol;
+    const char *end;
+    int res;
+
+    if (!re->req){
+        return re_exec(re,ctx,str,len,match);
+    }
+    end = str+len;
+    bol = str;
+    while(bol<end && (r = re_req_search(re,bol,end-bol))){
+        eol = memchr(r,0x0a,end-r);
+        eol = eol? eol+1:end;
+        if (r-bol>REQ_GAP){
+            r = memrchr(bol,0x0a,r-bol);
+            bol = r? r+1:bol;
+        }
+        if ((res = re_exec(re,ctx,bol,eol-bol,match))){
+            if (res>0){
+                match->start += bol-str;
+            }
+            return res;
+        }
+        bol = eol;
+    }
+    return 0;
+}
+
+int str_find(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match){
+    const char *r;
+
+    if ((r = lit_search(str,len,re->pattern,re->plen,re->rare))){
+        match->start = r-str;
+        match->len = re->plen;
+        return 1;
+    }
+    return 0;
+}
+
+int str_casefind(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match){
+    const char *r;
+
+    if ((r = lit_casesearch(str,len,re->pattern,re->plen,re->rare))){
+        match->start = r-str;
+        match->len = re->plen;
+        return 1;
+    }
+    return 0;
+}
+
+#define IS_WORD(c) (isalnum((unsigned char)(c)) || (c) == '_')
+
+/* first hit in s where \b would match before it, str is the subject start */
+const char *word_search(re_t *re,const char *str,const char *s,long len){
+    const char *r;
+
+    while(re->plen && len>=re->plen){
+        r = re->caseless? lit_casesearch(s,len,re->pattern,re->plen,re->rare):lit_search(s,len,re->pattern,re->plen,re->rare);
+        if (!r){
+            break;
+        }
+        if ((r>str && IS_WORD(r[-1])) != IS_WORD(r[0])){
+            return r;
+        }
+        len -= r+1-s;
+        s = r+1;
+    }
+    return NULL;
+}
+
+int word_findall(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *matches, int matches_len){
     const char *r;
     int nmatches = 0;
 
-    while(len && nmatches<matches_len && (r = _strncasestr(str,len,re->pattern,re->plen))){
+    /* each search starts a new subject, as re_findall() does */
+    while(len && nmatches<matches_len && (r = word_search(re,str,str,len))){
         nmatches++;
         matches->start = r-str;
         matches->len = re->plen;
@@ -993,6 +1711,17 @@ int str_casefindall(re_t *re,const char *str,long len,match_t *matches, int matc
     return nmatches;
 }
 
+int word_find(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match){
+    const char *r;
+
+    if ((r = word_search(re,str,str,len))){
+        match->start = r-str;
+        match->len = re->plen;
+        return 1;
+    }
+    return 0;
+}
+
 /*
 inline int simple_matches(re_t *re,char *str, long len) {
     vars.nmatches = 0;
@@ -1013,6 +1742,39 @@ inline int simple_matches(re_t *re,char *str, long len) {
 
 */
 
+/* dirname and name joined, the result lives till the next call */
+char *path_join(const char *dirname,int dirlen,const char *name) {
+    size_t len;
+    size_t size;
+    char *tmp;
+
+    if (!dirname){
+        return (char*)name;
+    }
+    len = strlen(name);
+    size = dirlen+len+2;
+    if (vars.fullname.allocated<size){
+        tmp = realloc(vars.fullname.buf,size*2);
+        if (!tmp){
+            return (char*)name;
+        }
+        vars.fullname.buf = tmp;
+        vars.fullname.allocated = size*2;
+    }
+    memcpy(vars.fullname.buf,dirname,dirlen);
+    vars.fullname.buf[dirlen] = DIRSEPC;
+    memcpy(&vars.fullname.buf[dirlen+1],name,len+1);
+    return vars.fullname.buf;
+}
+
+/* the walker opens files relative to their directory, the name to print is made on demand */
+char *file_fullname(file_t *file) {
+    if (!file->fullname){
+        file->fullname = path_join(file->dirname,file->dirlen,file->name);
+    }
+    return file->fullname;
+}
+
 char *_basename(char* fullname) {
     char *f2;
     char *f1;
@@ -1110,368 +1872,3124 @@ char *_strnstr3(const char *s,int sl, const char *f,int fl){
 }
 
 
-const char* strncasechr(const char *s,int sl,char uch, char lch)
-{
-   register char v;
-   register int i;
-
-   if (sl){
-      i = 0;
-      while( (v = s[i]) && i<sl){
-         if (v == lch || v == uch){
-            return &s[i];
-         }
-         i++;
-      }
-   }
-   return NULL;
-}
-
-char *_strncasestr(const char *s,int sl, const char *f,int fl){
-    const char *ptr;
-    const char *eptr;
-
-    if(sl<fl){
-        return NULL;
-    }
-
-    if (f && fl){
-        int ei = fl-1;
-        int mi = ei/2;
-        char ufirst = toupper(*f);
-        char lfirst = tolower(ufirst);
 
 
-        eptr = s+sl-ei;
-
-        ptr = strncasechr(s,eptr-s,ufirst,lfirst);
-        if (ptr){
-           char le;
-           char ue;
-           char lm;
-           char um;
-           char v;
+/* ==== literal search ==== */
+/*
+ * The vector kernels compare two bytes of the needle against a whole
+ * vector of positions at once and call memcmp() only where both match.
+ * The two bytes are the rarest ones of the needle by lit_rank[], so
+ * " return" does not stop on every space. The tail shorter than a
+ * vector goes to lit_search_tail().
+ */
 
-           le = tolower(f[ei]);
-           ue = toupper(le);
+/* how common each byte is in source code and text, 0 is the rarest */
+static const unsigned char lit_rank[256] = {
+      0,  1,  2,  3,  4,  5,  6,  7,  8,186,246,  9,144, 10, 11, 12,
+     13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 77, 24, 25, 26, 27,
+    255,162,245,213,164,163,166,209,217,218,200,172,235,212,233,231,
+    221,224,203,193,191,179,180,175,182,178,234,194,185,211,189,167,
+    192,220,204,216,199,230,196,208,184,228,165,176,226,188,214,207,
+    202,161,215,223,227,190,173,170,201,174,177,198,187,197,159,241,
+    168,252,232,243,242,254,238,229,236,247,171,195,244,237,249,251,
+    240,181,250,248,253,239,222,210,219,225,183,206,169,205,160, 28,
+    157,146,145,142,128, 83, 91,115,123,108, 99, 92,116,103, 84, 78,
+     89, 80, 87,135,154, 96, 81,105,147,153, 90,117,148,149, 88,111,
+    151,130,100,120,136,101,137,124, 74,155, 93,140,106,134,121, 97,
+    104,143, 85,132,118,127,141, 79,122, 82, 86,138,131,109,125,110,
+     29, 30,156,152, 95,133, 31, 32, 33, 34, 35, 36, 75, 37,112, 38,
+    139,102, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 52,
+    114, 76,158,150, 94,129,126,107,113,119, 53, 54, 55, 56, 57, 98,
+     58, 59, 60, 61, 62, 63, 64, 65, 66, 67, 68, 69, 70, 71, 72, 73,
+};
 
-           lm = tolower(f[mi]);
-           um = toupper(lm);
+/* offsets of the rarest and the second rarest byte of f */
+void lit_rare(const char *f,int fl,int caseless,int *rare) {
+    int r[2];
+    int k;
+    int c;
+    int i;
 
-           while(ptr && (ptr<eptr)){
-              v = ptr[ei];
-              if (v == le || v == ue){
-                 v = ptr[mi];
-                 if (v == lm || v == um){
-                    if (!STRNCASECMP(ptr,f,ei)){
-                       return (char*)ptr;
-                    }
-                 }
-              }
-              ptr++;
-              ptr = strncasechr(ptr,eptr-ptr,ufirst,lfirst);
-           }
+    rare[0] = rare[1] = 0;
+    r[0] = r[1] = 256;
+    for(i=0;i<fl;i++){
+        c = (unsigned char)f[i];
+        k = lit_rank[c];
+        if (caseless && lit_rank[tolower(c)]>k){
+            k = lit_rank[tolower(c)];
+        }
+        if (caseless && lit_rank[toupper(c)]>k){
+            k = lit_rank[toupper(c)];
+        }
+        if (k<r[0]){
+            r[1] = r[0];
+            rare[1] = rare[0];
+            r[0] = k;
+            rare[0] = i;
+        }else if (k<r[1]){
+            r[1] = k;
+            rare[1] = i;
         }
     }
-    return NULL;
 }
 
+/* memchr() on the rarest byte, then the second one, then the whole needle */
+char *lit_search_tail(const char *s,int sl,const char *f,int fl,const int *rare) {
+    const char *p;
+    const char *e;
+    int d;
 
-char *_strnstr1(const char *s, const char *f, int sl){
-
-#if 0
-    int fl;
-    register const char *ptr;
-    register const char *eptr;
-
-
-
-    if (f && *f){
-        ptr = _strnchr(s,sl,*f);
-        if (ptr){
-            fl = strlen(f);
-            if (!memcmp(ptr,f,fl)){
-                return (char*)ptr;
-            }
-            eptr = s+sl-fl+1;
-            ptr++;
-            while(ptr<eptr){
-                ptr = _strnchr(ptr,eptr-ptr,*f);
-                if (ptr){
-                    if (!memcmp(ptr,f,fl)){
-                        return (char*)ptr;
-                    }
-                    ptr++;
-                }else{
-                    break;
-                }
-            }
+    if (sl<fl){
+        return NULL;
+    }
+    d = rare[1]-rare[0];
+    p = s+rare[0];
+    e = s+sl-fl+1+rare[0];
+    while(p<e && (p = memchr(p,f[rare[0]],e-p))){
+        if (p[d] == f[rare[1]] && !memcmp(p-rare[0],f,fl)){
+            return (char*)p-rare[0];
         }
-    }else{
-        return (char*)s;
+        p++;
     }
     return NULL;
-#else
-   int fl;
-   fl = strlen(f);
-
-   return strnstr(s,sl,f,fl);
-#endif
 }
 
-char *analyse_header(char *str,int len) {
-    char **ptr;
-    char *name;
-
+#ifdef USE_SIMD
+__attribute__((target("sse2")))
+char *lit_search_sse2(const char *s,int sl,const char *f,int fl,const int *rare) {
+    const __m128i first = _mm_set1_epi8(f[rare[0]]);
+    const __m128i last = _mm_set1_epi8(f[rare[1]]);
+    unsigned int mask;
+    int bit;
+    int i;
 
-    name = str;
-    if (name){
-        for(ptr = interprets;*ptr;ptr++){
-            if(_strnstr1(name,*ptr,len)){
-                return *ptr;
+    for(i=0;i+fl-1+16<=sl;i+=16){
+        mask = _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpeq_epi8(first,_mm_loadu_si128((const __m128i*)(s+i+rare[0]))),
+                    _mm_cmpeq_epi8(last,_mm_loadu_si128((const __m128i*)(s+i+rare[1])))));
+        while(mask){
+            bit = __builtin_ctz(mask);
+            if (!memcmp(s+i+bit,f,fl)){
+                return (char*)s+i+bit;
             }
+            mask &= mask-1;
         }
+    }
+    return lit_search_tail(s+i,sl-i,f,fl,rare);
+}
 
-        for(ptr = shells;*ptr;ptr++){
-            if(_strnstr1(name,*ptr,len)){
-                return "shell";
+__attribute__((target("avx2")))
+char *lit_search_avx2(const char *s,int sl,const char *f,int fl,const int *rare) {
+    const __m256i first = _mm256_set1_epi8(f[rare[0]]);
+    const __m256i last = _mm256_set1_epi8(f[rare[1]]);
+    unsigned int mask;
+    int bit;
+    int i;
+
+    for(i=0;i+fl-1+32<=sl;i+=32){
+        mask = _mm256_movemask_epi8(_mm256_and_si256(
+                    _mm256_cmpeq_epi8(first,_mm256_loadu_si256((const __m256i*)(s+i+rare[0]))),
+                    _mm256_cmpeq_epi8(last,_mm256_loadu_si256((const __m256i*)(s+i+rare[1])))));
+        while(mask){
+            bit = __builtin_ctz(mask);
+            if (!memcmp(s+i+bit,f,fl)){
+                return (char*)s+i+bit;
             }
+            mask &= mask-1;
         }
-
     }
-    return NULL;
+    return lit_search_sse2(s+i,sl-i,f,fl,rare);
 }
 
+__attribute__((target("avx512bw")))
+char *lit_search_avx512(const char *s,int sl,const char *f,int fl,const int *rare) {
+    const __m512i first = _mm512_set1_epi8(f[rare[0]]);
+    const __m512i last = _mm512_set1_epi8(f[rare[1]]);
+    unsigned long long mask;
+    int bit;
+    int i;
 
-char* analyse_internals(file_t *file) {
-    int size;
-    char *ptr;
-    char *res = "text";
-
-    size = read_file(&file->buf,file->f,1024);
-    if (size>0){
-        vars.size_processed+=size;
-
-        if ( (size>6) && (0==STRNCASECMP(file->buf.buf,"<?xml ",6))){
-            res = "xml";
-        }else if ( (file->buf.buf[0] == '#') && (file->buf.buf[1] == '!')){
-            /* find 0x0a */
-            ptr = _strnchr(file->buf.buf,size,0x0a);
-            if (ptr){
-                ptr = analyse_header(file->buf.buf,ptr-file->buf.buf);
-                if (ptr){
-                    res = ptr;
-                }
-                /*
-                 * types:
-                 * - shell,TEXT == (?:ba|t?c|k|z)?sh) == bash|t*sh|ksh|zsh|sh
-                 * - $2,TEXT    == (ruby|perl|php|python)
-                 * */
-
-            }
-        }else{
-            ptr = _strnchr(file->buf.buf,size,0x00);
-            if (!ptr){
-                res = "text";
-            }else{
-                res = "binary";
-                //printf("%s: binary on %04x\n",file->fullname,ptr-file->buf.buf); // XXX
-                file->is_binary = 1;
+    for(i=0;i+fl-1+64<=sl;i+=64){
+        mask = _mm512_cmpeq_epi8_mask(first,_mm512_loadu_si512(s+i+rare[0])) &
+            _mm512_cmpeq_epi8_mask(last,_mm512_loadu_si512(s+i+rare[1]));
+        while(mask){
+            bit = __builtin_ctzll(mask);
+            if (!memcmp(s+i+bit,f,fl)){
+                return (char*)s+i+bit;
             }
+            mask &= mask-1;
         }
-    }else{
     }
-    return res;
+    return lit_search_avx2(s+i,sl-i,f,fl,rare);
 }
+#endif
 
+/*
+ * Caseless search: every fingerprint byte is compared with both its
+ * cases, candidates are verified with lit_casecmp().
+ */
+unsigned char lit_fold[256];
 
-void out_line(buf_t *line) {
-    fwrite(line->buf,1,line->used,stdout);
+int lit_casecmp(const char *s,const char *f,int n) {
+    const unsigned char *a = (const unsigned char*)s;
+    const unsigned char *b = (const unsigned char*)f;
+
+    while(n && lit_fold[*a] == lit_fold[*b]){
+        a++;
+        b++;
+        n--;
+    }
+    return n;
 }
 
-void out_context(char *name,buf_t *str,long line,long column,int is_match, match_t* matches,int nmatches) {
-    char ch = is_match? ':':'-';
-    char *ptr;
-    char *end;
+char *lit_casesearch_tail(const char *s,int sl,const char *f,int fl,const int *rare) {
+    unsigned char first = lit_fold[(unsigned char)f[rare[0]]];
+    unsigned char last = lit_fold[(unsigned char)f[rare[1]]];
     int i;
-    match_t *mptr;
 
-    if (opt.show_filename){
-        if (!opt.heading){
-            printf("%s%c",name,ch);
-        }
-        if (opt.color){
-            printf("%s%ld\e[0m\e[K%c",opt.color_lineno,line,ch);
-        }else{
-            printf("%ld%c",line,ch);
+    for(i=0;i+fl<=sl;i++){
+        if (lit_fold[(unsigned char)s[i+rare[0]]] == first && lit_fold[(unsigned char)s[i+rare[1]]] == last &&
+                !lit_casecmp(s+i,f,fl)){
+            return (char*)s+i;
         }
     }
-    if (opt.column){
-        printf("%ld%c",column,ch);
-    }
-    if (opt.o){
-        if (is_match && matches){
-            mptr = matches;
-            ptr=str->buf;
-            for(i=0;i<nmatches;i++){
-                ptr+=mptr->start;
-                fwrite(ptr,1,mptr->len,stdout);
-                ptr+=mptr->len;
-                printf("\n");
-                mptr++;
-            }
-        }
-    }else{
-        if (str->used){
-            ptr = str->buf+str->used;
-            ptr--;
-            while(str->used && ((*ptr == 0x0d) || (*ptr== 0x0a))){
-                ptr--;
-                str->used--;
-            }
-            assert((str->buf-1)<=ptr);
-        }
-        if (nmatches == 0 || !opt.color){
-            out_line(str);
-        }else{
-            mptr = matches;
-            ptr = str->buf;
-            end = ptr+str->used;
-            for(i=0;i<nmatches;i++){
-                fwrite(ptr,1,mptr->start,stdout);
-                fprintf(stdout,"%s",opt.color_match);
-                ptr+=mptr->start;
-                fwrite(ptr,1,mptr->len,stdout);
-                fprintf(stdout,"\e[0m\e[K");
-                //fwrite(str->buf+cstart+clen,1,str->used-(cstart+clen),stdout);
-                ptr+=mptr->len;
-                mptr++;
-            }
-            if (ptr<end){
-                fwrite(ptr,1,end-ptr,stdout);
+    return NULL;
+}
+
+#ifdef USE_SIMD
+__attribute__((target("sse2")))
+char *lit_casesearch_sse2(const char *s,int sl,const char *f,int fl,const int *rare) {
+    const __m128i lfirst = _mm_set1_epi8(tolower((unsigned char)f[rare[0]]));
+    const __m128i ufirst = _mm_set1_epi8(toupper((unsigned char)f[rare[0]]));
+    const __m128i llast = _mm_set1_epi8(tolower((unsigned char)f[rare[1]]));
+    const __m128i ulast = _mm_set1_epi8(toupper((unsigned char)f[rare[1]]));
+    __m128i a;
+    __m128i b;
+    unsigned int mask;
+    int bit;
+    int i;
+
+    for(i=0;i+fl-1+16<=sl;i+=16){
+        a = _mm_loadu_si128((const __m128i*)(s+i+rare[0]));
+        b = _mm_loadu_si128((const __m128i*)(s+i+rare[1]));
+        mask = _mm_movemask_epi8(_mm_and_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(lfirst,a),_mm_cmpeq_epi8(ufirst,a)),
+                    _mm_or_si128(_mm_cmpeq_epi8(llast,b),_mm_cmpeq_epi8(ulast,b))));
+        while(mask){
+            bit = __builtin_ctz(mask);
+            if (!lit_casecmp(s+i+bit,f,fl)){
+                return (char*)s+i+bit;
             }
+            mask &= mask-1;
         }
-        printf("\n");
-
     }
+    return lit_casesearch_tail(s+i,sl-i,f,fl,rare);
 }
 
-long analize_file(file_t *file) {
-    buf_t *p;
-    int res;
-    buf_t *hptr;
-
-    vars.hprint = 0;
-    vars.hused = 0;
+__attribute__((target("avx2")))
+char *lit_casesearch_avx2(const char *s,int sl,const char *f,int fl,const int *rare) {
+    const __m256i lfirst = _mm256_set1_epi8(tolower((unsigned char)f[rare[0]]));
+    const __m256i ufirst = _mm256_set1_epi8(toupper((unsigned char)f[rare[0]]));
+    const __m256i llast = _mm256_set1_epi8(tolower((unsigned char)f[rare[1]]));
+    const __m256i ulast = _mm256_set1_epi8(toupper((unsigned char)f[rare[1]]));
+    __m256i a;
+    __m256i b;
+    unsigned int mask;
+    int bit;
+    int i;
 
-    p = &vars.history[vars.hused];
-    p->used = 0;
-    while(get_line(p,file)){
-        file->line++;
-        if (opt.passthru){
-            out_line(p);
-            p->used = 0;
-            continue;
+    for(i=0;i+fl-1+32<=sl;i+=32){
+        a = _mm256_loadu_si256((const __m256i*)(s+i+rare[0]));
+        b = _mm256_loadu_si256((const __m256i*)(s+i+rare[1]));
+        mask = _mm256_movemask_epi8(_mm256_and_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(lfirst,a),_mm256_cmpeq_epi8(ufirst,a)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(llast,b),_mm256_cmpeq_epi8(ulast,b))));
+        while(mask){
+            bit = __builtin_ctz(mask);
+            if (!lit_casecmp(s+i+bit,f,fl)){
+                return (char*)s+i+bit;
+            }
+            mask &= mask-1;
         }
-        if ((opt.v != 0 ) != (0 != (vars.nmatches=simple_match(&opt.match,p->buf,p->used,vars.matches,OFFSETS_SIZE)))){
-            if (opt.show_context){
-                if(file->is_binary){
-                    if (vars.files_matched && !file->nmatches){
-                        printf("\n");
-                    }
-                    printf("Binary file %s matches\n",file->fullname);
-                    return 1;
-                }else{
-                    if (opt.show_filename && opt._break){
-                        if (vars.files_matched && !file->nmatches){
-                            printf("\n");
-                        }
-                    }
-                    if (opt.heading && opt.show_filename){
-                        if (!file->nmatches){
-                            if (opt.color){
-                                printf("%s",opt.color_filename);
-                            }
-                            printf("%s\n",file->fullname);
-                            if(opt.color){
-                                printf("\e[0m\e[K");
-
-                            }
-                        }
-                    }else{
-                    }
-                    if((opt.A || opt.B) && (file->nmatches || !opt.heading)){
-                        printf("--\n");
-                    }
+    }
+    return lit_casesearch_sse2(s+i,sl-i,f,fl,rare);
+}
 
-                    vars.hprint = opt.A;
-                    hptr = vars.history;
-                    while(vars.hused){
-                        out_context(file->fullname,hptr,file->line-vars.hused,0,0,0,0);
-                        hptr->used = 0;
-                        hptr++;
-                        vars.hused--;
-                    }
-                    out_context(file->fullname,p,file->line,vars.matches->start+1,1,vars.matches,vars.nmatches);
-                    p = &vars.history[vars.hused];
-                }
-            }
-            file->nmatches++;
-            if ((opt.m && (opt.m==file->nmatches))){
-                break;
-            }
+__attribute__((target("avx512bw")))
+char *lit_casesearch_avx512(const char *s,int sl,const char *f,int fl,const int *rare) {
+    const __m512i lfirst = _mm512_set1_epi8(tolower((unsigned char)f[rare[0]]));
+    const __m512i ufirst = _mm512_set1_epi8(toupper((unsigned char)f[rare[0]]));
+    const __m512i llast = _mm512_set1_epi8(tolower((unsigned char)f[rare[1]]));
+    const __m512i ulast = _mm512_set1_epi8(toupper((unsigned char)f[rare[1]]));
+    __m512i a;
+    __m512i b;
+    unsigned long long mask;
+    int bit;
+    int i;
 
-        }else{
-            if (vars.hprint){
-                out_context(file->fullname,p,file->line,0,0,0,0);
-                vars.hprint--;
-            }else{
-                if (opt.B){
-                    if (vars.hused >= opt.B){
-                        buf_t ttt;
-                        ttt = vars.history[0];
-                        memmove(&vars.history[0],&vars.history[1],sizeof(buf_t)*(vars.hused));
-                        vars.history[vars.hused] = ttt;
-                    }else{
-                        vars.hused++;
-                    }
-                    p = &vars.history[vars.hused];
-                }
+    for(i=0;i+fl-1+64<=sl;i+=64){
+        a = _mm512_loadu_si512(s+i+rare[0]);
+        b = _mm512_loadu_si512(s+i+rare[1]);
+        mask = (_mm512_cmpeq_epi8_mask(lfirst,a) | _mm512_cmpeq_epi8_mask(ufirst,a)) &
+            (_mm512_cmpeq_epi8_mask(llast,b) | _mm512_cmpeq_epi8_mask(ulast,b));
+        while(mask){
+            bit = __builtin_ctzll(mask);
+            if (!lit_casecmp(s+i+bit,f,fl)){
+                return (char*)s+i+bit;
             }
+            mask &= mask-1;
         }
-        p->used = 0;
-
     }
+    return lit_casesearch_avx2(s+i,sl-i,f,fl,rare);
+}
+#endif
 
-    vars.hused=0;
-    p->used = 0;
+/* newlines in p, the vector kernels popcount the compare masks */
+long nl_count_tail(const char *p,long len) {
+    const char *end = p+len;
+    long n = 0;
 
-    res = file->nmatches? 1:0;
-    return res;
+    while(p<end && (p = memchr(p,0x0a,end-p))){
+        p++;
+        n++;
+    }
+    return n;
 }
 
+#ifdef USE_SIMD
+__attribute__((target("sse2")))
+long nl_count_sse2(const char *p,long len) {
+    const __m128i nl = _mm_set1_epi8(0x0a);
+    long n = 0;
+    long i;
 
-void get_filetypes(file_t *file) {
-    ext_t *ext;
-    filetype_t *ft;
-    int len;
-    int res;
-    char *type;
-
-    if (file->type_processed)
-        return;
+    for(i=0;i+16<=len;i+=16){
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(nl,_mm_loadu_si128((const __m128i*)(p+i)))));
+    }
+    return n+nl_count_tail(p+i,len-i);
+}
 
-    file->type_processed = 1;
-    res = 0;
+__attribute__((target("avx2,popcnt")))
+long nl_count_avx2(const char *p,long len) {
+    const __m256i nl = _mm256_set1_epi8(0x0a);
+    unsigned long long lo;
+    unsigned long long hi;
+    long n = 0;
+    long i;
 
-    if (!is_searchable(file)){
-        // "skiped"
-        bf_set(file->filetypes,vars.ft_skipped->i);
-        return;
+    for(i=0;i+64<=len;i+=64){
+        lo = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(nl,_mm256_loadu_si256((const __m256i*)(p+i))));
+        hi = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(nl,_mm256_loadu_si256((const __m256i*)(p+i+32))));
+        n += __builtin_popcountll(lo|hi<<32);
     }
+    return n+nl_count_sse2(p+i,len-i);
+}
+#endif
 
+/*
+ * Binary check: a NUL byte makes the data binary. With --binary=utf8 in
+ * a UTF-8 locale so does a byte sequence that is not UTF-8, a Latin-1
+ * source is text otherwise. The vector kernels skip to the first NUL or
+ * non-ASCII byte, only the sequences from there on are decoded one by
+ * one.
+ */
+int text_utf8; /* --binary=utf8 and the locale is UTF-8, set by lit_init() */
 
-    if ( (type = analyse_internals(file)) ){
+long text_skip_tail(const char *p,long len) {
+    long i;
+
+    for(i=0;i<len && (signed char)p[i]>0;i++){
+    }
+    return i;
+}
+
+#ifdef USE_SIMD
+__attribute__((target("sse2")))
+long text_skip_sse2(const char *p,long len) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a;
+    int mask;
+    long i;
+
+    for(i=0;i+16<=len;i+=16){
+        a = _mm_loadu_si128((const __m128i*)(p+i));
+        /* NUL bytes compare to 0xff, non-ASCII ones have the top bit */
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(zero,a),a));
+        if (mask){
+            return i+__builtin_ctz(mask);
+        }
+    }
+    return i+text_skip_tail(p+i,len-i);
+}
+
+__attribute__((target("avx2")))
+long text_skip_avx2(const char *p,long len) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i a;
+    __m256i b;
+    unsigned long long lo;
+    unsigned long long hi;
+    long i;
+
+    for(i=0;i+64<=len;i+=64){
+        a = _mm256_loadu_si256((const __m256i*)(p+i));
+        b = _mm256_loadu_si256((const __m256i*)(p+i+32));
+        lo = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(zero,a),a));
+        hi = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(zero,b),b));
+        if (lo|hi){
+            return i+__builtin_ctzll(lo|hi<<32);
+        }
+    }
+    return i+text_skip_sse2(p+i,len-i);
+}
+#endif
+
+char *(*lit_kernel)(const char *s,int sl,const char *f,int fl,const int *rare) = lit_search_tail;
+char *(*lit_casekernel)(const char *s,int sl,const char *f,int fl,const int *rare) = lit_casesearch_tail;
+long (*nl_kernel)(const char *p,long len) = nl_count_tail;
+long (*text_kernel)(const char *p,long len) = text_skip_tail;
+
+/* called after setlocale(), the case folding follows the locale */
+void lit_init() {
+    const char *loc;
+    int i;
+
+    for(i=0;i<256;i++){
+        lit_fold[i] = tolower(i);
+    }
+    loc = setlocale(LC_CTYPE,NULL);
+    text_utf8 = opt.binary_utf8 && loc && (strstr(loc,"UTF-8") || strstr(loc,"utf-8") || strstr(loc,"UTF8") || strstr(loc,"utf8"));
+#ifdef USE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        nl_kernel = nl_count_avx2;
+        text_kernel = text_skip_avx2;
+    }else if (__builtin_cpu_supports("sse2")){
+        nl_kernel = nl_count_sse2;
+        text_kernel = text_skip_sse2;
+    }
+    if (__builtin_cpu_supports("avx512bw")){
+        lit_kernel = lit_search_avx512;
+        lit_casekernel = lit_casesearch_avx512;
+    }else if (__builtin_cpu_supports("avx2")){
+        lit_kernel = lit_search_avx2;
+        lit_casekernel = lit_casesearch_avx2;
+    }else if (__builtin_cpu_supports("sse2")){
+        lit_kernel = lit_search_sse2;
+        lit_casekernel = lit_casesearch_sse2;
+    }
+#endif
+}
+
+char *lit_search(const char *s,int sl,const char *f,int fl,const int *rare) {
+    if (fl<2){
+        return _strnstr3(s,sl,f,fl);
+    }
+    return lit_kernel(s,sl,f,fl,rare);
+}
+
+char *lit_casesearch(const char *s,int sl,const char *f,int fl,const int *rare) {
+    if (!fl || sl<fl){
+        return NULL;
+    }
+    return lit_casekernel(s,sl,f,fl,rare);
+}
+
+/* length of the UTF-8 sequence at p, 0 if it is not valid (RFC 3629) */
+int utf8_len(const unsigned char *p,long len) {
+    unsigned char lo;
+    unsigned char hi;
+    int n;
+    int i;
+
+    if (p[0]<0xc2 || p[0]>0xf4){
+        return 0;
+    }
+    n = p[0]<0xe0? 2:p[0]<0xf0? 3:4;
+    if (len<n){
+        return 0;
+    }
+    /* no overlong forms, surrogates or code points past 0x10ffff */
+    lo = p[0] == 0xe0? 0xa0:p[0] == 0xf0? 0x90:0x80;
+    hi = p[0] == 0xed? 0x9f:p[0] == 0xf4? 0x8f:0xbf;
+    if (p[1]<lo || p[1]>hi){
+        return 0;
+    }
+    for(i=2;i<n;i++){
+        if ((p[i]&0xc0) != 0x80){
+            return 0;
+        }
+    }
+    return n;
+}
+
+/* length of the text at p, len if none of it is binary */
+long text_len(const char *p,long len) {
+    const char *ptr;
+    long i;
+    int n;
+
+    if (!text_utf8){
+        ptr = memchr(p,0x00,len);
+        return ptr? ptr-p:len;
+    }
+    i = 0;
+    while((i += text_kernel(p+i,len-i))<len){
+        if (!p[i] || !(n = utf8_len((const unsigned char*)p+i,len-i))){
+            return i;
+        }
+        i += n;
+    }
+    return len;
+}
+
+/* ==== multi-pattern search ==== */
+/*
+ * --patterns-from: a set of literals is compiled into an Aho-Corasick
+ * DFA over byte classes, so the input is scanned once whatever the
+ * number of patterns. For a few patterns a Teddy-like vector prefilter
+ * skips to the bytes that can start one of them. The regular
+ * expressions of a set go to PCRE as alternations of a few KB each, a
+ * search takes the leftmost match of the literals and of the chunks.
+ */
+struct{
+    buf_t text;
+    char **list;
+    int *lens;
+    int *lines; /* line of each pattern in the file, for --show-pattern */
+    int n;
+    char **lits; /* the literals of the set */
+    int *litlens;
+    int *ids; /* pattern of each literal */
+    buf_t re; /* the alternations, one after another */
+}patterns;
+
+struct ac{
+    int nclasses;
+    unsigned char classes[256]; /* byte -> class, case folded for -i */
+    int nstates;
+    int *next; /* nstates*nclasses */
+    int *out; /* pattern ending in the state, -1 if none */
+    int *dict; /* next state on the suffix chain with a pattern, 0 if none */
+    int *lens;
+    int *ids; /* id of each pattern, NULL if its index */
+    int maxlen;
+    skipset_t first; /* bytes that start a pattern */
+};
+
+int load_patterns(char *fname) {
+    FILE *fp;
+    char *tmp;
+    char *ptr;
+    char *end;
+    size_t res;
+    int n;
+
+    fp = fopen(fname,"rb");
+    if (!fp){
+        fprintf(stderr,"%s: %s: %s\n",opt.self_name,fname,strerror(errno));
+        return 0;
+    }
+    do{
+        if (patterns.text.used+BUFFER_SIZE+1>patterns.text.allocated){
+            tmp = realloc(patterns.text.buf,patterns.text.allocated+BUFFER_SIZE+1);
+            if (!tmp){
+                fclose(fp);
+                return 0;
+            }
+            patterns.text.buf = tmp;
+            patterns.text.allocated += BUFFER_SIZE+1;
+        }
+        res = fread(patterns.text.buf+patterns.text.used,1,BUFFER_SIZE,fp);
+        patterns.text.used += res;
+    }while(res);
+    fclose(fp);
+    patterns.text.buf[patterns.text.used] = 0;
+
+    n = 1;
+    end = patterns.text.buf+patterns.text.used;
+    for(ptr = patterns.text.buf;ptr<end;ptr++){
+        n += *ptr == 0x0a;
+    }
+    patterns.list = malloc(n*sizeof(char*));
+    patterns.lens = malloc(n*sizeof(int));
+    patterns.lines = malloc(n*sizeof(int));
+    if (!patterns.list || !patterns.lens || !patterns.lines){
+        return 0;
+    }
+    n = 0;
+    for(ptr = patterns.text.buf;ptr<end;ptr = tmp+1){
+        n++;
+        tmp = memchr(ptr,0x0a,end-ptr);
+        if (!tmp){
+            tmp = end;
+        }
+        *tmp = 0;
+        if (tmp>ptr && tmp[-1] == 0x0d){
+            tmp[-1] = 0;
+        }
+        if (*ptr){
+            patterns.lines[patterns.n] = n;
+            patterns.lens[patterns.n] = strlen(ptr);
+            patterns.list[patterns.n++] = ptr;
+        }
+    }
+    if (!patterns.n){
+        fprintf(stderr,"%s: %s: No patterns found\n",opt.self_name,fname);
+        return 0;
+    }
+    return 1;
+}
+
+void patterns_free() {
+    free(patterns.text.buf);
+    free(patterns.list);
+    free(patterns.lens);
+    free(patterns.lines);
+    free(patterns.lits);
+    free(patterns.litlens);
+    free(patterns.ids);
+    free(patterns.re.buf);
+}
+
+void ac_free(ac_t *ac) {
+    if (ac){
+        free(ac->next);
+        free(ac->out);
+        free(ac->dict);
+        free(ac);
+    }
+}
+
+ac_t *ac_build(char **list,int *lens,int *ids,int n,int caseless) {
+    ac_t *ac;
+    int *queue;
+    int *fail;
+    long total;
+    int i;
+    int j;
+    int c;
+    int st;
+    int *nx;
+
+    ac = calloc(1,sizeof(ac_t));
+    if (!ac){
+        return NULL;
+    }
+    total = 1;
+    for(i=0;i<n;i++){
+        total += lens[i];
+        if (lens[i]>ac->maxlen){
+            ac->maxlen = lens[i];
+        }
+        for(j=0;j<lens[i];j++){
+            c = (unsigned char)list[i][j];
+            ac->classes[caseless? lit_fold[c]:c] = 1;
+        }
+    }
+    ac->nclasses = 1;
+    for(c=0;c<256;c++){
+        if (ac->classes[c]){
+            ac->classes[c] = ac->nclasses++;
+        }
+    }
+    if (caseless){
+        for(c=0;c<256;c++){
+            ac->classes[c] = ac->classes[lit_fold[c]];
+        }
+    }
+
+    ac->next = malloc(total*ac->nclasses*sizeof(int));
+    ac->out = malloc(total*sizeof(int));
+    ac->dict = calloc(total,sizeof(int));
+    queue = malloc(total*sizeof(int));
+    fail = calloc(total,sizeof(int));
+    if (!ac->next || !ac->out || !ac->dict || !queue || !fail){
+        free(queue);
+        free(fail);
+        ac_free(ac);
+        return NULL;
+    }
+    ac->lens = lens;
+    ac->ids = ids;
+
+    /* trie */
+    ac->nstates = 1;
+    memset(ac->next,-1,ac->nclasses*sizeof(int));
+    ac->out[0] = -1;
+    for(i=0;i<n;i++){
+        st = 0;
+        for(j=0;j<lens[i];j++){
+            nx = &ac->next[st*ac->nclasses+ac->classes[(unsigned char)list[i][j]]];
+            if (*nx<0){
+                *nx = ac->nstates;
+                memset(&ac->next[ac->nstates*ac->nclasses],-1,ac->nclasses*sizeof(int));
+                ac->out[ac->nstates] = -1;
+                ac->nstates++;
+            }
+            st = *nx;
+        }
+        if (ac->out[st]<0){
+            /* the first of equal patterns wins */
+            ac->out[st] = i;
+        }
+        c = (unsigned char)list[i][0];
+        ac->first.first[c] = 1;
+        if (caseless){
+            ac->first.first[tolower(c)] = 1;
+            ac->first.first[toupper(c)] = 1;
+        }
+    }
+
+    /* fail links folded into the transitions, breadth first */
+    i = 0;
+    j = 0;
+    for(c=0;c<ac->nclasses;c++){
+        nx = &ac->next[c];
+        if (*nx<0){
+            *nx = 0;
+        }else{
+            queue[j++] = *nx;
+        }
+    }
+    while(i<j){
+        st = queue[i++];
+        for(c=0;c<ac->nclasses;c++){
+            nx = &ac->next[st*ac->nclasses+c];
+            if (*nx<0){
+                *nx = ac->next[fail[st]*ac->nclasses+c];
+            }else{
+                fail[*nx] = ac->next[fail[st]*ac->nclasses+c];
+                ac->dict[*nx] = ac->out[fail[*nx]]>=0? fail[*nx]:ac->dict[fail[*nx]];
+                queue[j++] = *nx;
+            }
+        }
+    }
+    free(queue);
+    free(fail);
+
+    skipset_init(&ac->first);
+    return ac;
+}
+
+/* fills in the nibble tables once first is set */
+void skipset_init(skipset_t *ss) {
+    int n;
+    int c;
+
+    n = 0;
+    for(c=0;c<256;c++){
+        if (ss->first[c]){
+            n++;
+            ss->lo[c&0x0f] |= 1<<((c>>4)&7);
+            ss->hi[c>>4] = 1<<((c>>4)&7);
+        }
+    }
+#ifdef USE_SIMD
+    ss->simd = n<=16 && __builtin_cpu_supports("avx2");
+#endif
+}
+
+#ifdef USE_SIMD
+/* next position that may hold one of the bytes, bytes above 0x7f may be false hits */
+__attribute__((target("avx2")))
+long skip_avx2(const skipset_t *ss,const unsigned char *p,long i,long len) {
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ss->lo));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ss->hi));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i v;
+    __m256i m;
+    unsigned int mask;
+
+    for(;i+32<=len;i+=32){
+        v = _mm256_loadu_si256((const __m256i*)(p+i));
+        m = _mm256_and_si256(_mm256_shuffle_epi8(lo,_mm256_and_si256(v,nibble)),
+                _mm256_shuffle_epi8(hi,_mm256_and_si256(_mm256_srli_epi16(v,4),nibble)));
+        mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(m,_mm256_setzero_si256()));
+        if (mask){
+            return i+__builtin_ctz(mask);
+        }
+    }
+    return i;
+}
+#endif
+
+/* next position holding one of the bytes, len if none */
+long skip_to(const skipset_t *ss,const unsigned char *p,long i,long len) {
+#ifdef USE_SIMD
+    if (ss->simd){
+        /* the vector scan stops on false hits too */
+        while((i = skip_avx2(ss,p,i,len))+32<=len && !ss->first[p[i]]){
+            i++;
+        }
+    }
+#endif
+    while(i<len && !ss->first[p[i]]){
+        i++;
+    }
+    return i;
+}
+
+/* leftmost match, of those starting there the first in the file */
+int ac_find(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match) {
+    const ac_t *ac = re->ac;
+    const unsigned char *p = (const unsigned char*)str;
+    long best;
+    long start;
+    int bestid;
+    int st;
+    int t;
+    long i;
+
+    best = -1;
+    bestid = 0;
+    st = 0;
+    for(i=0;i<len;i++){
+        if (!st && ac->first.simd){
+            i = skip_to(&ac->first,p,i,len);
+            if (i>=len){
+                break;
+            }
+        }
+        st = ac->next[st*ac->nclasses+ac->classes[p[i]]];
+        for(t = ac->out[st]>=0? st:ac->dict[st];t;t = ac->dict[t]){
+            start = i+1-ac->lens[ac->out[t]];
+            if (re->word && (start && IS_WORD(p[start-1])) == IS_WORD(p[start])){
+                /* -w, no word boundary before the hit */
+                continue;
+            }
+            if (best<0 || start<best || (start == best && ac->out[t]<bestid)){
+                best = start;
+                bestid = ac->out[t];
+            }
+        }
+        if (best>=0 && i+1-best>=ac->maxlen){
+            /* nothing longer can start earlier */
+            break;
+        }
+    }
+    if (best<0){
+        return 0;
+    }
+    match->start = best;
+    match->len = ac->lens[bestid];
+    match->id = ac->ids? ac->ids[bestid]:bestid;
+    return 1;
+}
+
+int ac_findall(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *matches, int matches_len){
+    int nmatches = 0;
+    match_t m;
+
+    while(len && nmatches<matches_len && ac_find(re,ctx,str,len,&m)){
+        nmatches++;
+        if (matches){
+            *matches++ = m;
+        }
+        str += m.start+m.len;
+        len -= m.start+m.len;
+    }
+    return nmatches;
+}
+
+/* leftmost match of the literals and the chunks, exec runs a chunk, -1 if one failed */
+int set_exec(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match,int (*exec)(re_t*,re_ctx_t*,const char*,long,match_t*)) {
+    match_t m;
+    int found;
+    int res;
+    int i;
+
+    found = re->ac && ac_find(re,ctx,str,len,match);
+    for(i=0;i<re->nsubs;i++){
+        if ((res = exec(&re->subs[i],ctx->subs[i],str,len,&m))<0){
+            return -1;
+        }
+        if (!res){
+            continue;
+        }
+        if (!found || m.start<match->start || (m.start == match->start && m.id<match->id)){
+            *match = m;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+int re_first(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match) {
+    return re->findall(re,ctx,str,len,match,1);
+}
+
+int re_block(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match) {
+    return re->find(re,ctx,str,len,match);
+}
+
+int set_findall(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *matches, int matches_len){
+    int nmatches = 0;
+    match_t m;
+
+    while(len && nmatches<matches_len && set_exec(re,ctx,str,len,&m,re_first)){
+        nmatches++;
+        if (matches){
+            *matches++ = m;
+        }
+        str += m.start+m.len;
+        len -= m.start+m.len;
+    }
+    return nmatches;
+}
+
+int set_find(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match){
+    return set_exec(re,ctx,str,len,match,re_block);
+}
+
+/* match state for the chunks of a set, 0 if out of memory */
+int re_ctx_subs(re_t *re,re_ctx_t *ctx) {
+    if (!re->nsubs){
+        return 1;
+    }
+    ctx->subs = calloc(re->nsubs,sizeof(re_ctx_t*));
+    if (!ctx->subs){
+        return 0;
+    }
+    for(;ctx->nsubs<re->nsubs;ctx->nsubs++){
+        if (!(ctx->subs[ctx->nsubs] = re_ctx_new(&re->subs[ctx->nsubs]))){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void re_ctx_subs_free(re_ctx_t *ctx) {
+    int i;
+
+    for(i=0;i<ctx->nsubs;i++){
+        re_ctx_free(ctx->subs[i]);
+    }
+    free(ctx->subs);
+}
+
+int patterns_compile(re_t *re,int options) {
+    re_t *sub;
+    char *chunk;
+    char *p;
+    size_t size;
+    int nlits;
+    int i;
+    int k;
+
+    patterns.lits = malloc(patterns.n*sizeof(char*));
+    patterns.litlens = malloc(patterns.n*sizeof(int));
+    patterns.ids = malloc(patterns.n*sizeof(int));
+    re->subs = calloc(patterns.n,sizeof(re_t));
+    if (!patterns.lits || !patterns.litlens || !patterns.ids || !re->subs){
+        fprintf(stderr,"%s: "__FILE__":"STR(__LINE__)" OOM\n",opt.self_name);
+        return 0;
+    }
+    nlits = 0;
+    size = 1;
+    for(i=0;i<patterns.n;i++){
+        if (opt.Q || !is_regexp(patterns.list[i],patterns.lens[i])){
+            patterns.lits[nlits] = patterns.list[i];
+            patterns.litlens[nlits] = patterns.lens[i];
+            patterns.ids[nlits++] = i;
+        }else{
+            size += patterns.lens[i]+sizeof("\\b(?:(?:))")+(opt.show_pattern? sizeof("(*:)")+10:0);
+        }
+    }
+    re->word = opt.w;
+    if (nlits){
+        re->ac = ac_build(patterns.lits,patterns.litlens,patterns.ids,nlits,options & PCRE_CASELESS);
+        if (!re->ac){
+            fprintf(stderr,"%s: "__FILE__":"STR(__LINE__)" OOM\n",opt.self_name);
+            return 0;
+        }
+    }
+    if (nlits == patterns.n){
+        re->findall = ac_findall;
+        re->find = ac_find;
+        return 1;
+    }
+
+    /* \b(?:(?:p1)|(?:p2)|...) per chunk, --show-pattern marks each: (?:p1)(*:0) */
+    patterns.re.buf = malloc(size);
+    if (!patterns.re.buf){
+        fprintf(stderr,"%s: "__FILE__":"STR(__LINE__)" OOM\n",opt.self_name);
+        return 0;
+    }
+    p = patterns.re.buf;
+    chunk = NULL;
+    k = 0;
+    for(i=0;i<=patterns.n;i++){
+        if (i<patterns.n && k<nlits && patterns.ids[k] == i){
+            k++;
+            continue;
+        }
+        if (chunk && (i == patterns.n || p-chunk+patterns.lens[i]>PATTERNS_CHUNK)){
+            *p++ = ')';
+            *p++ = 0;
+            sub = &re->subs[re->nsubs++];
+            sub->marks = opt.show_pattern;
+            if (!compile(sub,chunk,options|PCRE_MULTILINE)){
+                return 0;
+            }
+            chunk = NULL;
+        }
+        if (i == patterns.n){
+            break;
+        }
+        if (!chunk){
+            chunk = p;
+            p += sprintf(p,opt.w? "\\b(?:(?:%s)":"(?:(?:%s)",patterns.list[i]);
+        }else{
+            p += sprintf(p,"|(?:%s)",patterns.list[i]);
+        }
+        if (opt.show_pattern){
+            p += sprintf(p,"(*:%d)",i);
+        }
+    }
+
+    if (!re->ac && re->nsubs == 1){
+        /* a single alternation searches as the pattern of its own */
+        sub = re->subs;
+        *re = *sub;
+        free(sub);
+        return 1;
+    }
+    re->findall = set_findall;
+    re->find = set_find;
+    for(i=0;i<re->nsubs;i++){
+        if (!re->subs[i].find){
+            re->find = NULL;
+        }
+    }
+    return 1;
+}
+
+/* ==== lazy DFA ==== */
+/*
+ * Patterns without back references, lookaround and the like run on a
+ * DFA built on demand from a Thompson NFA, so the time is linear in the
+ * input whatever the pattern. The forward automaton keeps the NFA
+ * threads in priority order and drops the ones behind a match, which
+ * ends the match where PCRE would. The start is then found by running
+ * the reversed pattern backwards from the end. States are cached, when
+ * the cache is full it is thrown away and built again.
+ */
+#define DFA_MAXNODES 2048 /* parse tree */
+#define DFA_MAXPROG 4096 /* NFA instructions */
+#define DFA_MAXSETS 256 /* distinct byte sets */
+#define DFA_MAXREP 1000 /* {n,m} bounds */
+#define DFA_STATES 1024 /* cached states per automaton */
+#define DFA_POOL (64*1024) /* NFA instructions of the cached states */
+#define DFA_HASH 4096
+#define DFA_END 256 /* pseudo byte after the end of the text */
+#define DFA_ACCEL 16 /* at most that many bytes start a match to skip to them */
+
+enum{
+    DN_SET,DN_CAT,DN_ALT,DN_REP,DN_EMPTY,DN_BOL,DN_EOL,DN_WB,DN_NWB
+};
+
+enum{
+    DI_SET,DI_SPLIT,DI_JMP,DI_MATCH,DI_BOL,DI_EOL,DI_WB,DI_NWB
+};
+
+/* state flags, DS_BOL and DS_WORD tell about the byte before */
+#define DS_BOL 1
+#define DS_WORD 2
+#define DS_MATCH 4 /* a match ended before the byte that led here */
+#define DS_DEAD 8
+#define DS_LAST 16 /* reverse start at the end of the text */
+#define DS_IDLE 32 /* no thread but the unanchored restart */
+
+typedef struct{
+    int type;
+    int a; /* sub nodes, the byte set for DN_SET */
+    int b;
+    int min; /* DN_REP, max is -1 if unbounded */
+    int max;
+    int greedy;
+}dfa_node_t;
+
+typedef struct{
+    int op;
+    int x; /* next instruction */
+    int y; /* alternative for DI_SPLIT, byte set for DI_SET */
+}dfa_inst_t;
+
+typedef struct{
+    dfa_inst_t *prog;
+    int nprog;
+    int longest; /* keep the threads behind a match */
+    int flagmask; /* DS_BOL, DS_WORD, DS_LAST if the pattern looks at them */
+    int accel; /* idle states skip to the bytes in first */
+    skipset_t first;
+    /* DFA_STATES rows of 257: (state+1)*257 so the row is at trans-257+value,
+       -state-1 for states that need a look, 0 if not built yet */
+    int *trans;
+    unsigned char *flags;
+    int *beg; /* NFA instructions of a state in pool */
+    int *len;
+    int *pool;
+    int npool;
+    int nstates;
+    int flushes;
+    int *hash;
+    int start[(DS_BOL|DS_WORD|DS_LAST)+1];
+    int *stack;
+    int *mark;
+    int gen;
+    int *list;
+    int *run;
+}dfa_auto_t;
+
+struct dfa{
+    unsigned char (*sets)[32];
+    int nsets;
+    unsigned char word[256];
+    dfa_auto_t fwd;
+    dfa_auto_t rev;
+};
+
+typedef struct dfa_parser{
+    const char *p;
+    int caseless;
+    int multiline;
+    int quote; /* inside \Q...\E */
+    int fail; /* not for the DFA, PCRE has to do it */
+    dfa_node_t *nodes;
+    int nnodes;
+    dfa_t *dfa;
+}dfa_parser_t;
+
+int dfa_alt(dfa_parser_t *ps);
+
+#define SET_ADD(set,c) ((set)[(c)>>3] |= 1<<((c)&7))
+#define SET_HAS(set,c) ((set)[(c)>>3] & 1<<((c)&7))
+
+int dfa_node(dfa_parser_t *ps,int type,int a,int b) {
+    dfa_node_t *n;
+
+    if (ps->nnodes == DFA_MAXNODES){
+        ps->fail = 1;
+        return 0;
+    }
+    n = ps->nodes+ps->nnodes;
+    memset(n,0,sizeof(*n));
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    return ps->nnodes++;
+}
+
+int dfa_nullable(dfa_node_t *nodes,int n) {
+    switch(nodes[n].type){
+    case DN_SET:
+        return 0;
+    case DN_CAT:
+        return dfa_nullable(nodes,nodes[n].a) && dfa_nullable(nodes,nodes[n].b);
+    case DN_ALT:
+        return dfa_nullable(nodes,nodes[n].a) || dfa_nullable(nodes,nodes[n].b);
+    case DN_REP:
+        return !nodes[n].min || dfa_nullable(nodes,nodes[n].a);
+    }
+    return 1;
+}
+
+/*
+ * Repeated groups and more than one unbounded repeat is where
+ * backtracking can blow up. Anything simpler runs faster on PCRE.
+ */
+int dfa_worth(dfa_node_t *nodes,int n,int *unbounded) {
+    switch(nodes[n].type){
+    case DN_CAT:
+    case DN_ALT:
+        return dfa_worth(nodes,nodes[n].a,unbounded) || dfa_worth(nodes,nodes[n].b,unbounded);
+    case DN_REP:
+        *unbounded += nodes[n].max<0;
+        return nodes[nodes[n].a].type != DN_SET || *unbounded>1;
+    }
+    return 0;
+}
+
+/* the case flipping is the one pcre_maketables() uses */
+void dfa_fold(unsigned char *set) {
+    unsigned char tmp[32];
+    int c;
+
+    memcpy(tmp,set,sizeof(tmp));
+    for(c=0;c<256;c++){
+        if (SET_HAS(tmp,c)){
+            SET_ADD(set,islower(c)? toupper(c):tolower(c));
+        }
+    }
+}
+
+int dfa_setnode(dfa_parser_t *ps,unsigned char *set) {
+    dfa_t *d;
+    int i;
+
+    d = ps->dfa;
+    for(i=0;i<d->nsets && memcmp(d->sets[i],set,32);i++){
+    }
+    if (i == DFA_MAXSETS){
+        ps->fail = 1;
+        return 0;
+    }
+    if (i == d->nsets){
+        memcpy(d->sets[d->nsets++],set,32);
+    }
+    return dfa_node(ps,DN_SET,i,0);
+}
+
+int dfa_char(dfa_parser_t *ps,int c) {
+    unsigned char set[32];
+
+    memset(set,0,sizeof(set));
+    SET_ADD(set,c);
+    if (ps->caseless){
+        dfa_fold(set);
+    }
+    return dfa_setnode(ps,set);
+}
+
+/* \d \w \s and the negations, 0 if c is not one of them */
+int dfa_escset(int c,unsigned char *set) {
+    int i;
+    int in;
+
+    if (!strchr("dDwWsS",c)){
+        return 0;
+    }
+    for(i=0;i<256;i++){
+        switch(tolower(c)){
+        case 'd':
+            in = isdigit(i);
+            break;
+        case 'w':
+            in = isalnum(i) || i == '_';
+            break;
+        default:
+            in = isspace(i);
+        }
+        if (!in == !islower(c)){
+            SET_ADD(set,i);
+        }
+    }
+    return 1;
+}
+
+/* escaped single byte at *pp (past the backslash), -1 if not supported */
+int dfa_escchar(const char **pp,int inclass) {
+    const char *p;
+    int c;
+    int i;
+
+    p = *pp;
+    (*pp)++;
+    switch(*p){
+    case 't':
+        return '\t';
+    case 'n':
+        return '\n';
+    case 'r':
+        return '\r';
+    case 'f':
+        return '\f';
+    case 'e':
+        return 27;
+    case 'a':
+        return 7;
+    case 'b':
+        return inclass? 8:-1;
+    case 'x':
+        c = 0;
+        for(i=1;i<3 && isxdigit((unsigned char)p[i]);i++){
+            c = c*16+(isdigit((unsigned char)p[i])? p[i]-'0':tolower((unsigned char)p[i])-'a'+10);
+        }
+        *pp += i-1;
+        return i>1? c:-1;
+    }
+    if (!*p || isalnum((unsigned char)*p) || *p & 0x80){
+        return -1;
+    }
+    return (unsigned char)*p;
+}
+
+/* [:name:], the sets pcre builds for them */
+int dfa_posix(const char *name,int len,unsigned char *set) {
+    static char *names[] = {"alpha","lower","upper","alnum","ascii","blank","cntrl",
+        "digit","graph","print","punct","space","word","xdigit",NULL};
+    int i;
+    int c;
+    int in;
+
+    for(i=0;names[i] && !(strlen(names[i]) == len && !memcmp(names[i],name,len));i++){
+    }
+    for(c=0;names[i] && c<256;c++){
+        switch(i){
+        case 0: in = isalnum(c) && !isdigit(c); break;
+        case 1: in = islower(c); break;
+        case 2: in = isupper(c); break;
+        case 3: in = isalnum(c); break;
+        case 4: in = c<128; break;
+        case 5: in = isspace(c) && !strchr("\n\v\f\r",c); break;
+        case 6: in = iscntrl(c); break;
+        case 7: in = isdigit(c); break;
+        case 8: in = isgraph(c); break;
+        case 9: in = isprint(c); break;
+        case 10: in = ispunct(c); break;
+        case 11: in = isspace(c); break;
+        case 12: in = isalnum(c) || c == '_'; break;
+        default: in = isxdigit(c);
+        }
+        if (in){
+            SET_ADD(set,c);
+        }
+    }
+    return names[i] != NULL;
+}
+
+/* [...], ps->p is past the '[' */
+int dfa_class(dfa_parser_t *ps) {
+    unsigned char chars[32]; /* what the case folding applies to */
+    unsigned char set[32];
+    const char *p;
+    const char *e;
+    int neg;
+    int lo;
+    int hi;
+    int i;
+
+    memset(chars,0,sizeof(chars));
+    memset(set,0,sizeof(set));
+    p = ps->p;
+    neg = *p == '^';
+    p += neg;
+    for(i=0;*p && (*p != ']' || !i);i++){
+        if (*p == '[' && p[1] && strchr(":.=",p[1])){
+            e = p[1] == ':'? strstr(p+2,":]"):NULL;
+            /* [:upper:] and [:lower:] are [:alpha:] with -i */
+            if (!e || !dfa_posix(p+2,e-p-2,strncmp(p+2,"upper:",6) && strncmp(p+2,"lower:",6)? set:chars)){
+                ps->fail = 1;
+                return 0;
+            }
+            p = e+2;
+            continue;
+        }
+        if (*p == '\\'){
+            if (dfa_escset(p[1],set)){
+                p += 2;
+                continue;
+            }
+            p++;
+            lo = dfa_escchar(&p,1);
+        }else{
+            lo = (unsigned char)*p++;
+        }
+        hi = lo;
+        if (*p == '-' && p[1] && p[1] != ']'){
+            p++;
+            if (*p == '['){
+                hi = -1;
+            }else if (*p == '\\'){
+                p++;
+                hi = dfa_escchar(&p,1);
+            }else{
+                hi = (unsigned char)*p++;
+            }
+        }
+        if (lo<0 || hi<lo){
+            ps->fail = 1;
+            return 0;
+        }
+        for(;lo<=hi;lo++){
+            SET_ADD(chars,lo);
+        }
+    }
+    if (*p != ']'){
+        ps->fail = 1;
+        return 0;
+    }
+    ps->p = p+1;
+    if (ps->caseless){
+        dfa_fold(chars);
+    }
+    for(i=0;i<32;i++){
+        set[i] |= chars[i];
+        set[i] = neg? ~set[i]:set[i];
+    }
+    return dfa_setnode(ps,set);
+}
+
+int dfa_atom(dfa_parser_t *ps) {
+    unsigned char set[32];
+    const char *p;
+    int n;
+    int c;
+
+    memset(set,0,sizeof(set));
+    p = ps->p;
+    switch(*p){
+    case '(':
+        if (p[1] == '?'){
+            if (p[2] != ':'){
+                ps->fail = 1;
+                return 0;
+            }
+            p += 2;
+        }
+        ps->p = p+1;
+        n = dfa_alt(ps);
+        if (*ps->p != ')'){
+            ps->fail = 1;
+            return 0;
+        }
+        ps->p++;
+        return n;
+    case '[':
+        ps->p++;
+        return dfa_class(ps);
+    case '.':
+        ps->p++;
+        memset(set,0xff,sizeof(set));
+        set['\n'>>3] &= ~(1<<('\n'&7));
+        return dfa_setnode(ps,set);
+    case '^':
+    case '$':
+        /* without multiline they would be about the whole text */
+        if (!ps->multiline){
+            ps->fail = 1;
+            return 0;
+        }
+        ps->p++;
+        return dfa_node(ps,*p == '^'? DN_BOL:DN_EOL,0,0);
+    case '*':
+    case '+':
+    case '?':
+        ps->fail = 1;
+        return 0;
+    case '\\':
+        if (p[1] == 'b' || p[1] == 'B'){
+            ps->p += 2;
+            return dfa_node(ps,p[1] == 'b'? DN_WB:DN_NWB,0,0);
+        }
+        if (dfa_escset(p[1],set)){
+            ps->p += 2;
+            return dfa_setnode(ps,set);
+        }
+        p++;
+        c = dfa_escchar(&p,0);
+        if (c<0){
+            ps->fail = 1;
+            return 0;
+        }
+        ps->p = p;
+        return dfa_char(ps,c);
+    }
+    ps->p++;
+    return dfa_char(ps,(unsigned char)*p);
+}
+
+/* quantifiers after node x */
+int dfa_quant(dfa_parser_t *ps,int x) {
+    const char *p;
+    char *e;
+    long min;
+    long max;
+    int n;
+
+    for(;;){
+        p = ps->p;
+        if (*p == '*' || *p == '+' || *p == '?'){
+            min = *p == '+';
+            max = *p == '?'? 1:-1;
+            p++;
+        }else if (*p == '{' && isdigit((unsigned char)p[1])){
+            min = max = strtol(p+1,&e,10);
+            if (*e == ','){
+                max = isdigit((unsigned char)e[1])? strtol(e+1,&e,10):(e++,-1);
+            }
+            if (*e != '}'){
+                /* just a brace */
+                return x;
+            }
+            p = e+1;
+        }else{
+            return x;
+        }
+        /* (a*)* and such are left to PCRE, it has its own ideas there */
+        if (min>DFA_MAXREP || max>DFA_MAXREP || (max>=0 && max<min) || *p == '+' || dfa_nullable(ps->nodes,x)){
+            ps->fail = 1;
+            return x;
+        }
+        n = dfa_node(ps,DN_REP,x,0);
+        ps->nodes[n].min = min;
+        ps->nodes[n].max = max;
+        ps->nodes[n].greedy = *p != '?';
+        ps->p = p+(*p == '?');
+        x = n;
+    }
+}
+
+int dfa_cat(dfa_parser_t *ps) {
+    int n;
+    int x;
+
+    n = -1;
+    while(!ps->fail){
+        if (ps->p[0] == '\\' && (ps->p[1] == 'E' || (ps->p[1] == 'Q' && !ps->quote))){
+            ps->quote = ps->p[1] == 'Q';
+            ps->p += 2;
+            continue;
+        }
+        if (ps->quote){
+            if (!*ps->p){
+                break;
+            }
+            x = dfa_char(ps,(unsigned char)*ps->p++);
+        }else{
+            if (!*ps->p || *ps->p == '|' || *ps->p == ')'){
+                break;
+            }
+            x = dfa_atom(ps);
+        }
+        /* a quantifier after \E is for the last quoted char */
+        if (ps->p[0] == '\\' && ps->p[1] == 'E'){
+            ps->quote = 0;
+            ps->p += 2;
+        }
+        if (!ps->quote && !ps->fail){
+            x = dfa_quant(ps,x);
+        }
+        n = n<0? x:dfa_node(ps,DN_CAT,n,x);
+    }
+    return n<0? dfa_node(ps,DN_EMPTY,0,0):n;
+}
+
+int dfa_alt(dfa_parser_t *ps) {
+    int n;
+
+    n = dfa_cat(ps);
+    while(!ps->fail && *ps->p == '|'){
+        ps->p++;
+        n = dfa_node(ps,DN_ALT,n,dfa_cat(ps));
+    }
+    return n;
+}
+
+int dfa_inst(dfa_auto_t *a,int op,int x,int y) {
+    if (a->nprog == DFA_MAXPROG){
+        return -1;
+    }
+    a->prog[a->nprog].op = op;
+    a->prog[a->nprog].x = x;
+    a->prog[a->nprog].y = y;
+    return a->nprog++;
+}
+
+/* Thompson construction, rev emits the pattern read backwards */
+int dfa_emit(dfa_auto_t *a,dfa_node_t *nodes,int n,int rev) {
+    dfa_node_t *node;
+    int pc;
+    int i;
+    int chain;
+
+    node = nodes+n;
+    switch(node->type){
+    case DN_SET:
+        return dfa_inst(a,DI_SET,a->nprog+1,node->a) >= 0;
+    case DN_CAT:
+        return dfa_emit(a,nodes,rev? node->b:node->a,rev) && dfa_emit(a,nodes,rev? node->a:node->b,rev);
+    case DN_ALT:
+        if ((pc = dfa_inst(a,DI_SPLIT,a->nprog+1,0))<0 || !dfa_emit(a,nodes,node->a,rev)){
+            return 0;
+        }
+        if ((i = dfa_inst(a,DI_JMP,0,0))<0){
+            return 0;
+        }
+        a->prog[pc].y = a->nprog;
+        if (!dfa_emit(a,nodes,node->b,rev)){
+            return 0;
+        }
+        a->prog[i].x = a->nprog;
+        return 1;
+    case DN_REP:
+        for(i=0;i<node->min;i++){
+            if (!dfa_emit(a,nodes,node->a,rev)){
+                return 0;
+            }
+        }
+        if (node->max<0){
+            if ((pc = dfa_inst(a,DI_SPLIT,0,0))<0 || !dfa_emit(a,nodes,node->a,rev) || dfa_inst(a,DI_JMP,pc,0)<0){
+                return 0;
+            }
+            a->prog[pc].x = node->greedy? pc+1:a->nprog;
+            a->prog[pc].y = node->greedy? a->nprog:pc+1;
+            return 1;
+        }
+        /* the optional copies, their splits are chained through y until the end is known */
+        chain = -1;
+        for(;i<node->max;i++){
+            if ((pc = dfa_inst(a,DI_SPLIT,0,chain))<0 || !dfa_emit(a,nodes,node->a,rev)){
+                return 0;
+            }
+            chain = pc;
+        }
+        for(;chain >= 0;chain = i){
+            i = a->prog[chain].y;
+            a->prog[chain].x = node->greedy? chain+1:a->nprog;
+            a->prog[chain].y = node->greedy? a->nprog:chain+1;
+        }
+        return 1;
+    case DN_BOL:
+    case DN_EOL:
+        if ((node->type == DN_BOL) != !!rev){
+            a->flagmask |= DS_BOL;
+            return dfa_inst(a,DI_BOL,a->nprog+1,0) >= 0;
+        }
+        a->flagmask |= rev? DS_LAST:0;
+        return dfa_inst(a,DI_EOL,a->nprog+1,0) >= 0;
+    case DN_WB:
+    case DN_NWB:
+        a->flagmask |= DS_WORD;
+        return dfa_inst(a,node->type == DN_WB? DI_WB:DI_NWB,a->nprog+1,0) >= 0;
+    }
+    return 1;
+}
+
+void dfa_flush(dfa_auto_t *a) {
+    a->nstates = 0;
+    a->npool = 0;
+    a->flushes++;
+    memset(a->hash,0,DFA_HASH*sizeof(int));
+    memset(a->start,-1,sizeof(a->start));
+}
+
+/* the cached state for a list of instructions, made if not there yet */
+int dfa_state(dfa_auto_t *a,int *list,int n,int flags) {
+    unsigned int h;
+    int s;
+    int i;
+
+    h = flags;
+    for(i=0;i<n;i++){
+        h = h*31+list[i];
+    }
+    h = (h^(h>>12))&(DFA_HASH-1);
+    while((s = a->hash[h])){
+        s--;
+        if ((a->flags[s]&~(DS_DEAD|DS_IDLE)) == flags && a->len[s] == n && !memcmp(a->pool+a->beg[s],list,n*sizeof(int))){
+            return s;
+        }
+        h = (h+1)&(DFA_HASH-1);
+    }
+    if (a->nstates == DFA_STATES || a->npool+n>DFA_POOL){
+        dfa_flush(a);
+        return dfa_state(a,list,n,flags);
+    }
+    s = a->nstates++;
+    a->beg[s] = a->npool;
+    a->len[s] = n;
+    memcpy(a->pool+a->npool,list,n*sizeof(int));
+    a->npool += n;
+    a->flags[s] = flags|(n? 0:DS_DEAD)|(a->accel && n == 1 && !list[0]? DS_IDLE:0);
+    memset(a->trans+s*257,0,257*sizeof(int));
+    a->hash[h] = s+1;
+    return s;
+}
+
+/* state after s reading byte c, or DFA_END */
+int dfa_next(dfa_t *d,dfa_auto_t *a,int s,int c) {
+    dfa_inst_t *in;
+    int *ids;
+    int n;
+    int i;
+    int sp;
+    int pc;
+    int nrun;
+    int nl;
+    int f;
+    int t;
+    int bol;
+    int eol;
+    int pword;
+    int nword;
+    int matched;
+    int flushes;
+
+    ids = a->pool+a->beg[s];
+    n = a->len[s];
+    bol = a->flags[s] & DS_BOL;
+    pword = (a->flags[s] & DS_WORD) != 0;
+    /* DI_EOL is a ^ in the reversed pattern, not true at the end of the text */
+    eol = c == DFA_END || (c == '\n' && !(a->flags[s] & DS_LAST));
+    nword = c != DFA_END && d->word[c];
+
+    /* the closure, in priority order */
+    a->gen++;
+    nrun = 0;
+    matched = 0;
+    for(i=0;i<n;i++){
+        sp = 0;
+        a->stack[sp++] = ids[i];
+        while(sp){
+            pc = a->stack[--sp];
+            if (a->mark[pc] == a->gen){
+                continue;
+            }
+            a->mark[pc] = a->gen;
+            in = a->prog+pc;
+            switch(in->op){
+            case DI_SET:
+                a->run[nrun++] = pc;
+                break;
+            case DI_MATCH:
+                matched = 1;
+                if (!a->longest){
+                    /* whatever comes after has a lower priority */
+                    sp = 0;
+                    i = n;
+                }
+                break;
+            case DI_SPLIT:
+                a->stack[sp++] = in->y;
+                a->stack[sp++] = in->x;
+                break;
+            case DI_JMP:
+                a->stack[sp++] = in->x;
+                break;
+            case DI_BOL:
+            case DI_EOL:
+            case DI_WB:
+            case DI_NWB:
+                /* ^ is not true after a newline ending the text */
+                if ((in->op == DI_BOL && bol && (c != DFA_END || a == &d->rev)) || (in->op == DI_EOL && eol)
+                    || (in->op == DI_WB && pword != nword) || (in->op == DI_NWB && pword == nword)){
+                    a->stack[sp++] = in->x;
+                }
+                break;
+            }
+        }
+    }
+
+    a->gen++;
+    nl = 0;
+    for(i=0;i<nrun && c != DFA_END;i++){
+        in = a->prog+a->run[i];
+        if (SET_HAS(d->sets[in->y],c) && a->mark[in->x] != a->gen){
+            a->mark[in->x] = a->gen;
+            a->list[nl++] = in->x;
+        }
+    }
+    f = ((c == '\n'? DS_BOL:0)|(nword? DS_WORD:0)) & a->flagmask;
+    flushes = a->flushes;
+    t = dfa_state(a,a->list,nl,f|(matched? DS_MATCH:0));
+    if (flushes == a->flushes){
+        a->trans[s*257+c] = a->flags[t] & (DS_MATCH|DS_DEAD|DS_IDLE)? -t-1:(t+1)*257;
+    }
+    return t;
+}
+
+int dfa_step(dfa_t *d,dfa_auto_t *a,int s,int c) {
+    int t;
+
+    t = a->trans[s*257+c];
+    return t>0? t/257-1:t<0? -t-1:dfa_next(d,a,s,c);
+}
+
+int dfa_start(dfa_auto_t *a,int flags) {
+    int pc;
+
+    flags &= a->flagmask;
+    if (a->start[flags]<0){
+        pc = 0;
+        a->start[flags] = dfa_state(a,&pc,1,flags);
+    }
+    return a->start[flags];
+}
+
+/* the bytes a match can start with */
+void dfa_first(dfa_t *d,dfa_auto_t *a) {
+    dfa_inst_t *in;
+    int sp;
+    int pc;
+    int c;
+    int n;
+
+    a->gen++;
+    sp = 0;
+    a->stack[sp++] = 2;
+    while(sp){
+        pc = a->stack[--sp];
+        if (a->mark[pc] == a->gen){
+            continue;
+        }
+        a->mark[pc] = a->gen;
+        in = a->prog+pc;
+        if (in->op == DI_SET){
+            for(c=0;c<256;c++){
+                a->first.first[c] |= SET_HAS(d->sets[in->y],c) != 0;
+            }
+        }else if (in->op != DI_MATCH){
+            /* assertions are taken as true, that makes more bytes not less */
+            a->stack[sp++] = in->x;
+            if (in->op == DI_SPLIT){
+                a->stack[sp++] = in->y;
+            }
+        }
+    }
+    for(c=n=0;c<256;c++){
+        n += a->first.first[c];
+    }
+    a->accel = n <= DFA_ACCEL;
+    skipset_init(&a->first);
+}
+
+int dfa_build(dfa_t *d,dfa_auto_t *a,dfa_node_t *nodes,int root,int rev) {
+    unsigned char any[32];
+    int i;
+
+    a->prog = malloc(DFA_MAXPROG*sizeof(dfa_inst_t));
+    if (!a->prog){
+        return 0;
+    }
+    a->longest = rev;
+    if (!rev){
+        /* unanchored: a lazy .* in front, below everything else */
+        memset(any,0xff,sizeof(any));
+        for(i=0;i<d->nsets && memcmp(d->sets[i],any,32);i++){
+        }
+        if (i == DFA_MAXSETS){
+            return 0;
+        }
+        if (i == d->nsets){
+            memcpy(d->sets[d->nsets++],any,32);
+        }
+        dfa_inst(a,DI_SPLIT,2,1);
+        dfa_inst(a,DI_SET,0,i);
+    }
+    if (!dfa_emit(a,nodes,root,rev) || dfa_inst(a,DI_MATCH,0,0)<0){
+        return 0;
+    }
+    a->trans = malloc(DFA_STATES*257*sizeof(int));
+    a->flags = malloc(DFA_STATES);
+    a->beg = malloc(DFA_STATES*sizeof(int));
+    a->len = malloc(DFA_STATES*sizeof(int));
+    a->pool = malloc(DFA_POOL*sizeof(int));
+    a->hash = malloc(DFA_HASH*sizeof(int));
+    a->stack = malloc((2*a->nprog+2)*sizeof(int));
+    a->mark = calloc(a->nprog,sizeof(int));
+    a->list = malloc(a->nprog*sizeof(int));
+    a->run = malloc(a->nprog*sizeof(int));
+    if (!a->trans || !a->flags || !a->beg || !a->len || !a->pool || !a->hash
+        || !a->stack || !a->mark || !a->list || !a->run){
+        return 0;
+    }
+    if (!rev){
+        dfa_first(d,a);
+    }
+    dfa_flush(a);
+    return 1;
+}
+
+void dfa_free(dfa_t *d) {
+    dfa_auto_t *a;
+    int i;
+
+    if (!d){
+        return;
+    }
+    for(i=0;i<2;i++){
+        a = i? &d->rev:&d->fwd;
+        free(a->prog);
+        free(a->trans);
+        free(a->flags);
+        free(a->beg);
+        free(a->len);
+        free(a->pool);
+        free(a->hash);
+        free(a->stack);
+        free(a->mark);
+        free(a->list);
+        free(a->run);
+    }
+    free(d->sets);
+    free(d);
+}
+
+/* NULL if the pattern is out of the DFA's reach */
+dfa_t *dfa_compile(const char *pattern,int options) {
+    dfa_parser_t ps;
+    dfa_t *d;
+    int root;
+    int c;
+    int unbounded;
+
+    memset(&ps,0,sizeof(ps));
+    d = calloc(1,sizeof(dfa_t));
+    ps.nodes = malloc(DFA_MAXNODES*sizeof(dfa_node_t));
+    if (!d || !ps.nodes || !(d->sets = malloc(DFA_MAXSETS*32))){
+        free(ps.nodes);
+        dfa_free(d);
+        return NULL;
+    }
+    for(c=0;c<256;c++){
+        d->word[c] = isalnum(c) || c == '_';
+    }
+    ps.p = pattern;
+    ps.caseless = (options & PCRE_CASELESS) != 0;
+    ps.multiline = (options & PCRE_MULTILINE) != 0;
+    /* . matches everything but a newline */
+    ps.fail = (options & PCRE_DOTALL) != 0;
+    ps.dfa = d;
+    root = dfa_alt(&ps);
+    unbounded = 0;
+    /* empty matches are not wanted (PCRE_NOTEMPTY), leave those to PCRE */
+    if (ps.fail || *ps.p || dfa_nullable(ps.nodes,root) || !dfa_worth(ps.nodes,root,&unbounded)
+        || !dfa_build(d,&d->fwd,ps.nodes,root,0) || !dfa_build(d,&d->rev,ps.nodes,root,1)){
+        free(ps.nodes);
+        dfa_free(d);
+        return NULL;
+    }
+    free(ps.nodes);
+    return d;
+}
+
+/* from an idle state at i on to the next byte that can start a match */
+long dfa_skip(dfa_t *d,dfa_auto_t *a,const unsigned char *s,long i,long len,int *st) {
+    long j;
+
+    /* short hops are cheaper without the vector scan */
+    for(j=i;j<len && j<i+16 && !a->first.first[s[j]];j++){
+    }
+    if (j == i+16){
+        j = skip_to(&a->first,s,j,len);
+    }
+    if (j>i && a->flagmask){
+        *st = dfa_start(a,(s[j-1] == '\n'? DS_BOL:0)|(d->word[s[j-1]]? DS_WORD:0));
+    }
+    return j;
+}
+
+/* leftmost-first match like pcre_exec() gives it */
+int dfa_exec(dfa_t *d,const char *str,long len,match_t *match) {
+    const unsigned char *s;
+    dfa_auto_t *a;
+    long i;
+    long beg;
+    long end;
+    int *rows;
+    int row;
+    int st;
+    int t;
+    int f;
+
+    s = (const unsigned char *)str;
+    a = &d->fwd;
+    rows = a->trans-257;
+    st = dfa_start(a,DS_BOL);
+    end = -1;
+    i = a->flags[st] & DS_IDLE? dfa_skip(d,a,s,0,len,&st):0;
+    for(row=(st+1)*257;i<len;i++){
+        t = rows[row+s[i]];
+        if (t<=0){
+            st = t? -t-1:dfa_next(d,a,row/257-1,s[i]);
+            f = a->flags[st];
+            if (f & DS_MATCH){
+                end = i;
+            }
+            if (f & DS_DEAD){
+                break;
+            }
+            if (f & DS_IDLE){
+                i = dfa_skip(d,a,s,i+1,len,&st)-1;
+            }
+            t = (st+1)*257;
+        }
+        row = t;
+    }
+    if (i == len && a->flags[dfa_step(d,a,row/257-1,DFA_END)] & DS_MATCH){
+        end = len;
+    }
+    if (end<0){
+        return 0;
+    }
+
+    a = &d->rev;
+    rows = a->trans-257;
+    st = dfa_start(a,end == len? DS_BOL|DS_LAST:(s[end] == '\n'? DS_BOL:0)|(d->word[s[end]]? DS_WORD:0));
+    beg = end;
+    for(row=(st+1)*257,i=end;i>0;i--){
+        t = rows[row+s[i-1]];
+        if (t<=0){
+            st = t? -t-1:dfa_next(d,a,row/257-1,s[i-1]);
+            f = a->flags[st];
+            if (f & DS_MATCH){
+                beg = i;
+            }
+            if (f & DS_DEAD){
+                break;
+            }
+            t = (st+1)*257;
+        }
+        row = t;
+    }
+    if (!i && a->flags[dfa_step(d,a,row/257-1,DFA_END)] & DS_MATCH){
+        beg = 0;
+    }
+    match->start = beg;
+    match->len = end-beg;
+    return 1;
+}
+
+char *_strnstr1(const char *s, const char *f, int sl){
+
+#if 0
+    int fl;
+    register const char *ptr;
+    register const char *eptr;
+
+
+
+    if (f && *f){
+        ptr = _strnchr(s,sl,*f);
+        if (ptr){
+            fl = strlen(f);
+            if (!memcmp(ptr,f,fl)){
+                return (char*)ptr;
+            }
+            eptr = s+sl-fl+1;
+            ptr++;
+            while(ptr<eptr){
+                ptr = _strnchr(ptr,eptr-ptr,*f);
+                if (ptr){
+                    if (!memcmp(ptr,f,fl)){
+                        return (char*)ptr;
+                    }
+                    ptr++;
+                }else{
+                    break;
+                }
+            }
+        }
+    }else{
+        return (char*)s;
+    }
+    return NULL;
+#else
+   int fl;
+   fl = strlen(f);
+
+   return strnstr(s,sl,f,fl);
+#endif
+}
+
+char *analyse_header(char *str,int len) {
+    char **ptr;
+    char *name;
+
+
+    name = str;
+    if (name){
+        for(ptr = interprets;*ptr;ptr++){
+            if(_strnstr1(name,*ptr,len)){
+                return *ptr;
+            }
+        }
+
+        for(ptr = shells;*ptr;ptr++){
+            if(_strnstr1(name,*ptr,len)){
+                return "shell";
+            }
+        }
+
+    }
+    return NULL;
+}
+
+
+char* analyse_internals(file_t *file) {
+    int size;
+    char *ptr;
+    char *res = "text";
+
+    if (file->whole){
+        size = file->buf.used<1024?file->buf.used:1024;
+    }else{
+        size = read_file(file,1024);
+    }
+    if (size>0){
+        vars.size_processed+=size;
+
+        if ( (size>6) && (0==STRNCASECMP(file->buf.buf,"<?xml ",6))){
+            res = "xml";
+        }else if ( (file->buf.buf[0] == '#') && (file->buf.buf[1] == '!')){
+            /* find 0x0a */
+            ptr = _strnchr(file->buf.buf,size,0x0a);
+            if (ptr){
+                ptr = analyse_header(file->buf.buf,ptr-file->buf.buf);
+                if (ptr){
+                    res = ptr;
+                }
+                /*
+                 * types:
+                 * - shell,TEXT == (?:ba|t?c|k|z)?sh) == bash|t*sh|ksh|zsh|sh
+                 * - $2,TEXT    == (ruby|perl|php|python)
+                 * */
+
+            }
+        }else{
+            ptr = _strnchr(file->buf.buf,size,0x00);
+            if (!ptr){
+                res = "text";
+            }else{
+                res = "binary";
+                //printf("%s: binary on %04x\n",file->fullname,ptr-file->buf.buf); // XXX
+                file->is_binary = 1;
+            }
+        }
+    }else{
+    }
+    return res;
+}
+
+
+void out_line(line_t *line) {
+    fwrite(line->ptr,1,line->len,stdout);
+}
+
+void out_context(char *name,line_t *str,long line,long column,int is_match, match_t* matches,int nmatches) {
+    char ch = is_match? ':':'-';
+    const char *ptr;
+    const char *end;
+    int i;
+    match_t *mptr;
+
+    if (opt.show_filename){
+        if (!opt.heading){
+            printf("%s%c",name,ch);
+        }
+    }
+    if (opt.show_lineno){
+        if (opt.color){
+            printf("%s%ld\e[0m\e[K%c",opt.color_lineno,line,ch);
+        }else{
+            printf("%ld%c",line,ch);
+        }
+    }
+    if (opt.column){
+        printf("%ld%c",column,ch);
+    }
+    if (opt.show_pattern && is_match && nmatches){
+        printf("%d%c",patterns.lines[matches->id],ch);
+    }
+    if (opt.o){
+        if (is_match && matches){
+            mptr = matches;
+            ptr=str->ptr;
+            for(i=0;i<nmatches;i++){
+                if (opt.show_pattern && i){
+                    printf("%d%c",patterns.lines[mptr->id],ch);
+                }
+                ptr+=mptr->start;
+                fwrite(ptr,1,mptr->len,stdout);
+                ptr+=mptr->len;
+                printf("\n");
+                mptr++;
+            }
+        }
+    }else{
+        if (str->len){
+            ptr = str->ptr+str->len;
+            ptr--;
+            while(str->len && ((*ptr == 0x0d) || (*ptr== 0x0a))){
+                ptr--;
+                str->len--;
+            }
+            assert((str->ptr-1)<=ptr);
+        }
+        if (nmatches == 0 || !opt.color){
+            out_line(str);
+        }else{
+            mptr = matches;
+            ptr = str->ptr;
+            end = ptr+str->len;
+            for(i=0;i<nmatches;i++){
+                fwrite(ptr,1,mptr->start,stdout);
+                fprintf(stdout,"%s",opt.color_match);
+                ptr+=mptr->start;
+                fwrite(ptr,1,mptr->len,stdout);
+                fprintf(stdout,"\e[0m\e[K");
+                //fwrite(str->buf+cstart+clen,1,str->used-(cstart+clen),stdout);
+                ptr+=mptr->len;
+                mptr++;
+            }
+            if (ptr<end){
+                fwrite(ptr,1,end-ptr,stdout);
+            }
+        }
+        printf("\n");
+
+    }
+}
+
+void out_binary(file_t *file) {
+    if (vars.files_matched && !file->nmatches){
+        printf("\n");
+    }
+    printf("Binary file %s matches\n",file_fullname(file));
+}
+
+/* break, heading and context separator printed before each matched line */
+void out_hit_header(file_t *file) {
+    if (opt.show_filename && opt._break){
+        if (vars.files_matched && !file->nmatches){
+            printf("\n");
+        }
+    }
+    if (opt.heading && opt.show_filename){
+        if (!file->nmatches){
+            if (opt.color){
+                printf("%s",opt.color_filename);
+            }
+            printf("%s\n",file_fullname(file));
+            if(opt.color){
+                printf("\e[0m\e[K");
+
+            }
+        }
+    }else{
+    }
+    if((opt.A || opt.B) && (file->nmatches || !opt.heading)){
+        printf("--\n");
+    }
+}
+
+/*
+ * Line by line search, used when the pattern or options don't allow
+ * a block search. A template like block_search(): passthru and context
+ * are constants in passthru_lines(), analize_lines() and count_lines(),
+ * so a loop that prints nothing carries no context bookkeeping.
+ */
+#ifdef __GNUC__
+__attribute__((always_inline))
+#endif
+static inline long lines_search(file_t *file,re_ctx_t *ctx,const int passthru,const int context) {
+    line_t *p;
+    int res;
+    int check;
+    int invert;
+    line_t *hptr;
+
+    vars.hprint = 0;
+    vars.hused = 0;
+    check = text_check(file);
+    invert = opt.v != 0;
+
+    p = &vars.history[vars.hused];
+    p->len = 0;
+    while(get_line(p,file)){
+        file->line++;
+        if (passthru){
+            out_line(p);
+            p->len = 0;
+            continue;
+        }
+        if (check && text_len(p->ptr,p->len)<p->len){
+            check = 0;
+            if (!text_binary(file)){
+                break;
+            }
+        }
+        if (invert != (0 != (vars.nmatches=simple_match(&opt.match,ctx,p->ptr,p->len,vars.matches,OFFSETS_SIZE)))){
+            if (context){
+                if(file->is_binary){
+                    out_binary(file);
+                    return 1;
+                }else{
+                    out_hit_header(file);
+
+                    vars.hprint = opt.A;
+                    hptr = vars.history;
+                    while(vars.hused){
+                        out_context(file_fullname(file),hptr,file->line-vars.hused,0,0,0,0);
+                        hptr->len = 0;
+                        hptr++;
+                        vars.hused--;
+                    }
+                    out_context(file_fullname(file),p,file->line,vars.matches->start+1,1,vars.matches,vars.nmatches);
+                    p = &vars.history[vars.hused];
+                }
+            }
+            file->nmatches += opt.count_matches && !invert? line_matches(ctx,p->ptr,p->len):1;
+            if ((opt.m && (opt.m<=file->nmatches))){
+                break;
+            }
+
+        }else if (context){
+            if (vars.hprint){
+                out_context(file_fullname(file),p,file->line,0,0,0,0);
+                vars.hprint--;
+            }else{
+                if (opt.B){
+                    if (vars.hused >= opt.B){
+                        line_t ttt;
+                        ttt = vars.history[0];
+                        memmove(&vars.history[0],&vars.history[1],sizeof(line_t)*(vars.hused));
+                        vars.history[vars.hused] = ttt;
+                    }else{
+                        vars.hused++;
+                    }
+                    p = &vars.history[vars.hused];
+                }
+            }
+        }
+        p->len = 0;
+
+    }
+
+    vars.hused=0;
+    p->len = 0;
+
+    res = file->nmatches? 1:0;
+    return res;
+}
+
+long passthru_lines(file_t *file,re_ctx_t *ctx) {
+    return lines_search(file,ctx,1,0);
+}
+
+long analize_lines(file_t *file,re_ctx_t *ctx) {
+    return lines_search(file,ctx,0,1);
+}
+
+/* -c, -l and the like, nothing is printed per line */
+long count_lines(file_t *file,re_ctx_t *ctx) {
+    return lines_search(file,ctx,0,0);
+}
+
+
+/*
+ * ===========================================================================
+ * block search
+ * ===========================================================================
+ */
+
+/* all offsets are relative to file->buf.buf */
+typedef struct{
+    long pos; /* first line not searched yet */
+    long end; /* end of the complete lines in the buffer */
+    long floor; /* end of the last printed line, leading context stops there */
+    long lno_off; /* lno lines are before this offset */
+    long lno;
+    long checked; /* end of the data checked for binary */
+    int check; /* the data is checked for binary before it is searched */
+    int after; /* trailing context lines left to print */
+    int eof;
+}scan_t;
+
+/* whether the data of the file has to be checked for binary, see --binary */
+int text_check(file_t *file) {
+    if (file->is_binary || opt.passthru){
+        return 0;
+    }
+    return opt.binary == BINARY_SKIP || opt.binary == BINARY_WITHOUT_MATCH ||
+        (opt.binary == BINARY_MATCHES && opt.show_context);
+}
+
+/* binary data found in the file, returns 0 if the file is dropped */
+int text_binary(file_t *file) {
+    file->is_binary = 1;
+    if (opt.binary == BINARY_MATCHES){
+        return 1;
+    }
+    file->nmatches = 0;
+    return 0;
+}
+
+/* number of the line starting at off, counted lazily from the last known one */
+long scan_lineno(file_t *file,scan_t *s,long off) {
+    if (!opt.show_lineno){
+        return 0;
+    }
+    assert(off>=s->lno_off);
+    s->lno += nl_kernel(file->buf.buf+s->lno_off,off-s->lno_off);
+    s->lno_off = off;
+    return s->lno+1;
+}
+
+long scan_eol(file_t *file,scan_t *s,long off) {
+    const char *ptr;
+
+    ptr = _strnchr(file->buf.buf+off,s->end-off,0x0a);
+    return ptr? ptr-file->buf.buf+1:s->end;
+}
+
+/* start of the n-th line before the line starting at off, but not below floor */
+long scan_back(file_t *file,long off,long floor,int n) {
+    const char *ptr;
+
+    while(n && off>floor){
+        ptr = memrchr(file->buf.buf+floor,0x0a,off-1-floor);
+        off = ptr? ptr-file->buf.buf+1:floor;
+        n--;
+    }
+    return off;
+}
+
+/* reads more data keeping the lines needed for the leading context, returns 0 on EOF */
+int scan_fill(file_t *file,scan_t *s) {
+    long keep;
+    long shift;
+    int res;
+
+    keep = s->pos;
+    if (opt.show_context && opt.B){
+        keep = scan_back(file,s->pos,s->floor,opt.B);
+    }
+    if (opt.show_context){
+        scan_lineno(file,s,keep);
+    }else{
+        s->lno_off = keep;
+    }
+    if (s->floor<keep){
+        s->floor = keep;
+    }
+    file->buf.used -= keep-file->buf.start;
+    file->buf.start = keep;
+
+    res = read_file(file,BUFFER_SIZE);
+
+    shift = keep-file->buf.start;
+    s->pos -= shift;
+    s->end -= shift;
+    s->floor -= shift;
+    s->lno_off -= shift;
+    s->checked -= shift;
+    return res>0;
+}
+
+/* makes sure there are complete lines after from, returns 0 if nothing is left after pos */
+int scan_more(file_t *file,scan_t *s,long from) {
+    const char *ptr;
+    long dend;
+
+    while(1){
+        dend = file->buf.start+file->buf.used;
+        if (from<dend){
+            ptr = memrchr(file->buf.buf+from,0x0a,dend-from);
+            if (ptr){
+                s->end = ptr-file->buf.buf+1;
+                return 1;
+            }
+        }
+        s->end = dend;
+        if (s->eof){
+            return s->pos<dend;
+        }
+        if (!scan_fill(file,s)){
+            s->eof = 1;
+        }
+        from = s->end;
+    }
+}
+
+int scan_lines(file_t *file,scan_t *s) {
+    return scan_more(file,s,s->pos);
+}
+
+/* checks the data up to end for binary, returns 0 if the file is dropped */
+int scan_text(file_t *file,scan_t *s,long end) {
+    if (s->check && s->checked<end){
+        s->checked += text_len(file->buf.buf+s->checked,end-s->checked);
+        if (s->checked<end){
+            s->check = 0;
+            return text_binary(file);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Length of the next block to search from s->pos, complete lines if there
+ * are any. When the data is checked for binary the block is kept small
+ * and is checked right before the search, so the data is read from
+ * memory once. Returns -1 if the file is dropped as binary.
+ */
+long scan_block(file_t *file,scan_t *s) {
+    const char *ptr;
+    long max;
+    long len;
+
+    max = s->check? TEXT_CHUNK:SCAN_MAX;
+    len = s->end-s->pos;
+    if (len>max){
+        ptr = memrchr(file->buf.buf+s->pos,0x0a,max);
+        len = ptr? ptr-(file->buf.buf+s->pos)+1:scan_eol(file,s,s->pos+max)-s->pos;
+        if (len>SCAN_MAX){
+            len = SCAN_MAX;
+        }
+    }
+    return scan_text(file,s,s->pos+len)? len:-1;
+}
+
+/* non-matching lines up to off, only the trailing context is printed */
+void scan_skip(file_t *file,scan_t *s,long off) {
+    line_t line;
+    long eol;
+
+    while(s->after && s->pos<off){
+        eol = scan_eol(file,s,s->pos);
+        line.ptr = file->buf.buf+s->pos;
+        line.len = eol-s->pos;
+        out_context(file_fullname(file),&line,scan_lineno(file,s,s->pos),0,0,0,0);
+        s->after--;
+        s->floor = eol;
+        s->pos = eol;
+    }
+    s->pos = off;
+}
+
+void scan_hit(file_t *file,scan_t *s,long bol,long eol) {
+    line_t line;
+    long lno;
+    long off;
+    long eol2;
+    int n;
+
+    out_hit_header(file);
+    lno = scan_lineno(file,s,bol);
+
+    off = scan_back(file,bol,s->floor,opt.B);
+    n = 0;
+    for(eol2 = off;eol2<bol;eol2 = scan_eol(file,s,eol2)){
+        n++;
+    }
+    while(n){
+        eol2 = scan_eol(file,s,off);
+        line.ptr = file->buf.buf+off;
+        line.len = eol2-off;
+        out_context(file_fullname(file),&line,lno-n,0,0,0,0);
+        off = eol2;
+        n--;
+    }
+
+    line.ptr = file->buf.buf+bol;
+    line.len = eol-bol;
+    out_context(file_fullname(file),&line,lno,vars.matches->start+1,1,vars.matches,vars.nmatches);
+    s->after = opt.A;
+    s->floor = eol;
+    s->pos = eol;
+}
+
+#ifdef USE_READ
+int write_all(int fd,const char *buf,size_t len) {
+    long res;
+
+    while(len){
+        res = write(fd,buf,len);
+        if (res<0){
+            if (errno == EINTR){
+                continue;
+            }
+            return 0;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 1;
+}
+
+/*
+ * --passthru prints the file as it is, so there is no need to split it
+ * into lines: the data is handed to stdout with sendfile() or splice()
+ * where the kernel allows that, with plain read()/write() otherwise.
+ */
+long passthru_file(file_t *file) {
+    buf_t *b;
+    long res;
+
+    fflush(stdout);
+    b = &file->buf;
+    if (b->used && !write_all(FSTDOUT_HANDLE,b->buf+b->start,b->used)){
+        return 0;
+    }
+    b->start = 0;
+    b->used = 0;
+    if (file->whole){
+        return 0;
+    }
+#ifdef USE_SENDFILE
+    if (!file->read){
+        while((res = sendfile(FSTDOUT_HANDLE,file->f,NULL,SCAN_MAX))>0){
+        }
+        if (!res){
+            return 0;
+        }
+        /* one of the ends is a pipe */
+        while((res = splice(file->f,NULL,FSTDOUT_HANDLE,NULL,SCAN_MAX,SPLICE_F_MOVE))>0){
+        }
+        if (!res){
+            return 0;
+        }
+    }
+#endif
+    while((res = read_file(file,BUFFER_SIZE))>0){
+        if (!write_all(FSTDOUT_HANDLE,b->buf+b->start,b->used)){
+            break;
+        }
+        b->start = 0;
+        b->used = 0;
+    }
+    return 0;
+}
+#endif
+
+/* --count-matches: all matches in a line, not only the first OFFSETS_SIZE */
+long line_matches(re_ctx_t *ctx,const char *str,long len) {
+    long n;
+    int k;
+    int i;
+
+    n = 0;
+    while(len && (k = simple_match(&opt.match,ctx,str,len,vars.matches,OFFSETS_SIZE))){
+        n += k;
+        if (k<OFFSETS_SIZE){
+            break;
+        }
+        /* the offsets are relative to the end of the match before */
+        for(i=0;i<k;i++){
+            str += vars.matches[i].start+vars.matches[i].len;
+            len -= vars.matches[i].start+vars.matches[i].len;
+        }
+    }
+    return n;
+}
+
+/*
+ * -c, -l and -L: the buffer is searched for the next hit and the search
+ * goes on from the end of its line, nothing is split out or copied. Only
+ * a regex is checked against the line alone, as the block may let it
+ * match across lines. -l and -L stop at the first hit by -m 1, the rest
+ * of the file is not even read.
+ */
+long count_file(file_t *file,re_ctx_t *ctx) {
+    scan_t s;
+    match_t m;
+    const char *buf;
+    const char *ptr;
+    long len;
+    long hit;
+    long bol;
+    long eol;
+    long n;
+
+    memset(&s,0,sizeof(s));
+    s.pos = s.end = s.floor = s.lno_off = s.checked = file->buf.start;
+    s.eof = file->whole;
+    s.check = text_check(file);
+
+    while(s.pos<s.end || scan_lines(file,&s)){
+        buf = file->buf.buf;
+        if ((len = scan_block(file,&s))<0){
+            return 0;
+        }
+        if (!block_find(ctx,buf+s.pos,len,&m)){
+            s.pos += len;
+            continue;
+        }
+        hit = s.pos+m.start;
+        eol = scan_eol(file,&s,hit);
+        n = 1;
+        if (opt.count_matches || opt.match.find == re_find || opt.match.find == set_find || hit+m.len>eol){
+            ptr = memrchr(buf+s.pos,0x0a,hit-s.pos);
+            bol = ptr? ptr-buf+1:s.pos;
+            if (opt.count_matches){
+                n = line_matches(ctx,buf+bol,eol-bol);
+            }else{
+                n = block_find(ctx,buf+bol,eol-bol,&m);
+            }
+        }
+        s.pos = eol;
+        file->nmatches += n;
+        if ((opt.m && (opt.m<=file->nmatches))){
+            break;
+        }
+    }
+    return file->nmatches? 1:0;
+}
+
+/* lines without a prefix, as out_context() prints them: CRs before a newline are dropped */
+void out_lines(const char *ptr,long len) {
+    const char *end;
+    const char *cr;
+    const char *p;
+
+    end = ptr+len;
+    while((cr = memchr(ptr,0x0d,end-ptr))){
+        for(p = cr;p<end && *p == 0x0d;p++){
+        }
+        fwrite(ptr,1,(p == end || *p == 0x0a? cr:p)-ptr,stdout);
+        ptr = p;
+    }
+    fwrite(ptr,1,end-ptr,stdout);
+    if (len && end[-1] != 0x0a){
+        printf("\n");
+    }
+}
+
+/* -v: the lines from off to end match nothing, 0 when -m is reached */
+int invert_run(file_t *file,scan_t *s,long off,long end) {
+    line_t line;
+    const char *buf;
+    const char *ptr;
+    long lno;
+    long eol;
+    long n;
+
+    buf = file->buf.buf;
+    n = nl_kernel(buf+off,end-off);
+    if (buf[end-1] != 0x0a){
+        n++;
+    }
+    if (opt.m && n>opt.m-file->nmatches){
+        n = opt.m-file->nmatches;
+        for(ptr = buf+off,eol = 0;eol<n;eol++){
+            ptr = memchr(ptr,0x0a,buf+end-ptr)+1;
+        }
+        end = ptr-buf;
+    }
+    if (opt.show_context){
+        out_hit_header(file);
+        if (!opt.show_lineno && !(opt.show_filename && !opt.heading)){
+            out_lines(buf+off,end-off);
+        }else{
+            lno = scan_lineno(file,s,off);
+            for(;off<end;off = eol){
+                eol = scan_eol(file,s,off);
+                line.ptr = buf+off;
+                line.len = eol-off;
+                out_context(file_fullname(file),&line,lno++,0,1,vars.matches,0);
+            }
+        }
+    }
+    file->nmatches += n;
+    return !(opt.m && opt.m<=file->nmatches);
+}
+
+/*
+ * -v: the lines between the hit lines are printed or counted a run at a
+ * time, the hit lines are found the way the block search finds them.
+ */
+long invert_file(file_t *file,re_ctx_t *ctx) {
+    scan_t s;
+    match_t m;
+    const char *buf;
+    const char *ptr;
+    long len;
+    long hit;
+    long bol;
+    long eol;
+
+    memset(&s,0,sizeof(s));
+    s.pos = s.end = s.floor = s.lno_off = s.checked = file->buf.start;
+    s.eof = file->whole;
+    s.check = text_check(file);
+
+    while(s.pos<s.end || scan_lines(file,&s)){
+        buf = file->buf.buf;
+        if ((len = scan_block(file,&s))<0){
+            return 0;
+        }
+        if (block_find(ctx,buf+s.pos,len,&m)){
+            hit = s.pos+m.start;
+            ptr = memrchr(buf+s.pos,0x0a,hit-s.pos);
+            bol = ptr? ptr-buf+1:s.pos;
+            eol = scan_eol(file,&s,hit);
+            if ((opt.match.find == re_find || opt.match.find == set_find || hit+m.len>eol) && !block_find(ctx,buf+bol,eol-bol,&m)){
+                /* the line matches only together with the next ones */
+                bol = eol;
+            }
+        }else{
+            bol = eol = s.pos+len;
+        }
+        if (s.pos<bol){
+            if (opt.show_context && file->is_binary){
+                out_binary(file);
+                return 1;
+            }
+            if (!invert_run(file,&s,s.pos,bol)){
+                break;
+            }
+        }
+        s.pos = eol;
+    }
+    return file->nmatches? 1:0;
+}
+
+/* -U: a regex goes over the block as a whole, not line by line as in re_find() */
+int multiline_find(re_t *re,re_ctx_t *ctx,const char *str,long len,match_t *match) {
+    int res;
+
+    if (re->findall == re_findall){
+        res = re_exec(re,ctx,str,len,match);
+    }else if (re->findall == set_findall){
+        res = set_exec(re,ctx,str,len,match,multiline_find);
+    }else{
+        res = re->find(re,ctx,str,len,match);
+    }
+    if (res<0){
+        re_warn(ctx);
+        return 0;
+    }
+    return res;
+}
+
+/* first match in a block, line by line where PCRE gives up on the block as a whole */
+int block_find(re_ctx_t *ctx,const char *str,long len,match_t *match) {
+    const char *bol;
+    const char *eol;
+    const char *end;
+    int res;
+
+    end = str+len;
+    if (str<ctx->lines || end>ctx->lines_end){
+        if ((res = opt.match.find(&opt.match,ctx,str,len,match))>=0){
+            return res;
+        }
+        if (len<2 || !memchr(str,0x0a,len-1)){
+            /* a single line */
+            re_warn(ctx);
+            return 0;
+        }
+        /* the rest of the block too */
+        ctx->lines = str;
+        ctx->lines_end = end;
+    }
+    for(bol = str;bol<end;bol = eol){
+        eol = memchr(bol,0x0a,end-bol);
+        eol = eol? eol+1:end;
+        if ((res = opt.match.find(&opt.match,ctx,bol,eol-bol,match))>0){
+            match->start += bol-str;
+            return 1;
+        }
+        if (res<0){
+            re_warn(ctx);
+        }
+    }
+    return 0;
+}
+
+/* -U: the lines from bol to eol hold the match from hit to end */
+void multiline_hit(file_t *file,re_ctx_t *ctx,scan_t *s,long bol,long eol,long hit,long end) {
+    match_t m;
+    line_t line;
+    const char *buf;
+    long off;
+    long eol2;
+    long le;
+
+    buf = file->buf.buf;
+    if (opt.o){
+        /* the matches that start before eol go together, offsets as re_findall() gives them */
+        vars.matches->start = hit-bol;
+        vars.matches->len = end-hit;
+        vars.nmatches = 1;
+        while(vars.nmatches<OFFSETS_SIZE && end<eol && multiline_find(&opt.match,ctx,buf+end,s->end-end,&m) && end+m.start<eol){
+            vars.matches[vars.nmatches++] = m;
+            end += m.start+m.len;
+            eol = scan_eol(file,s,end-1);
+        }
+        scan_hit(file,s,bol,eol);
+        return;
+    }
+    for(off = bol;off<eol;off = eol2){
+        eol2 = scan_eol(file,s,off);
+        /* the part of the match on this line, without the line end */
+        for(le = eol2;le>off && (buf[le-1] == 0x0a || buf[le-1] == 0x0d);le--){
+        }
+        vars.matches->start = (off<hit? hit:off)-off;
+        vars.matches->len = (end<le? end:le)-off-vars.matches->start;
+        vars.nmatches = vars.matches->len>0;
+        if (off == bol){
+            scan_hit(file,s,bol,eol2);
+        }else{
+            line.ptr = buf+off;
+            line.len = eol2-off;
+            out_context(file_fullname(file),&line,scan_lineno(file,s,off),vars.matches->start+1,1,vars.matches,vars.nmatches);
+        }
+    }
+    s->floor = eol;
+    s->pos = eol;
+}
+
+/*
+ * -U: the pattern is matched against the data as it is rather than line
+ * by line, so a match may span lines, and all of them are printed. A
+ * file that is read in parts is searched through a window: the last
+ * MULTILINE_WINDOW bytes are searched again together with the data read
+ * after them, a longer match across the window may be missed. With -v
+ * the lines no match touches are printed.
+ */
+long multiline_file(file_t *file,re_ctx_t *ctx) {
+    scan_t s;
+    match_t m;
+    const char *buf;
+    const char *ptr;
+    long len;
+    long hit;
+    long end;
+    long bol;
+    long eol;
+    int found;
+    int more;
+
+    memset(&s,0,sizeof(s));
+    s.pos = s.end = s.floor = s.lno_off = s.checked = file->buf.start;
+    s.eof = file->whole;
+    s.check = text_check(file);
+
+    while(s.pos<s.end || scan_lines(file,&s)){
+        len = s.end-s.pos;
+        if (len>SCAN_MAX){
+            len = SCAN_MAX;
+        }
+        if (!scan_text(file,&s,s.pos+len)){
+            return 0;
+        }
+        buf = file->buf.buf;
+        found = multiline_find(&opt.match,ctx,buf+s.pos,len,&m);
+        hit = end = -1;
+        more = 0;
+        if ((!s.eof || s.pos+len<s.end) && (!found || m.start+MULTILINE_WINDOW>len)){
+            /* a match may start in the tail and go on in the data to come */
+            bol = eol = s.pos;
+            if (len>MULTILINE_WINDOW){
+                ptr = memrchr(buf+s.pos,0x0a,len-MULTILINE_WINDOW);
+                if (ptr){
+                    bol = eol = ptr-buf+1;
+                }
+            }
+            more = 1;
+        }else if (!found){
+            bol = eol = s.pos+len;
+        }else{
+            hit = s.pos+m.start;
+            end = hit+m.len;
+            ptr = memrchr(buf+s.pos,0x0a,hit-s.pos);
+            bol = ptr? ptr-buf+1:s.pos;
+            eol = scan_eol(file,&s,end-1);
+        }
+        if (opt.v){
+            if (s.pos<bol){
+                if (opt.show_context && file->is_binary){
+                    out_binary(file);
+                    return 1;
+                }
+                if (!invert_run(file,&s,s.pos,bol)){
+                    break;
+                }
+            }
+            s.pos = eol;
+        }else if (hit<0){
+            scan_skip(file,&s,bol);
+        }else{
+            if (opt.show_context){
+                if (file->is_binary){
+                    out_binary(file);
+                    return 1;
+                }
+                scan_skip(file,&s,bol);
+                vars.matches->id = m.id;
+                multiline_hit(file,ctx,&s,bol,eol,hit,end);
+            }else{
+                s.pos = eol;
+            }
+            file->nmatches++;
+            if ((opt.m && (opt.m<=file->nmatches))){
+                break;
+            }
+        }
+        if (more){
+            scan_more(file,&s,s.end);
+        }
+    }
+    return file->nmatches? 1:0;
+}
+
+/* a hit line as out_context() prints it without colours, the prefix parts are optional */
+void out_plain(const char *name,int namelen,long lno,const char *ptr,long len) {
+    char num[24];
+    char *p;
+
+    if (name){
+        fwrite(name,1,namelen,stdout);
+        putc(':',stdout);
+    }
+    if (lno){
+        p = num+sizeof(num);
+        *--p = ':';
+        do{
+            *--p = '0'+lno%10;
+            lno /= 10;
+        }while(lno);
+        fwrite(p,1,num+sizeof(num)-p,stdout);
+    }
+    while(len && (ptr[len-1] == 0x0a || ptr[len-1] == 0x0d)){
+        len--;
+    }
+    fwrite(ptr,1,len,stdout);
+    putc(0x0a,stdout);
+}
+
+/*
+ * Searches the whole buffer for the next match and splits only
+ * the matched line out of it. A template for block_file() and
+ * plain_file(), plain is a constant there: without context, colours,
+ * -o, --column or --show-pattern a hit line is written out as it is,
+ * behind a prefix put together once per file, and a match is checked
+ * against its line only if the block may have let it match across lines.
+ */
+#ifdef __GNUC__
+__attribute__((always_inline))
+#endif
+static inline long block_search(file_t *file,re_ctx_t *ctx,const int plain) {
+    scan_t s;
+    match_t m;
+    const char *ptr;
+    const char *name;
+    int namelen;
+    long len;
+    long hit;
+    long bol;
+    long eol;
+
+    memset(&s,0,sizeof(s));
+    s.pos = s.end = s.floor = s.lno_off = s.checked = file->buf.start;
+    s.eof = file->whole;
+    s.check = text_check(file);
+    name = NULL;
+    namelen = 0;
+
+    while(s.pos<s.end || scan_lines(file,&s)){
+        if ((len = scan_block(file,&s))<0){
+            return 0;
+        }
+        if (!block_find(ctx,file->buf.buf+s.pos,len,&m)){
+            scan_skip(file,&s,s.pos+len);
+            continue;
+        }
+        hit = s.pos+m.start;
+        ptr = memrchr(file->buf.buf+s.pos,0x0a,hit-s.pos);
+        bol = ptr? ptr-file->buf.buf+1:s.pos;
+        eol = scan_eol(file,&s,hit);
+
+        if (plain){
+            if ((opt.match.find == re_find || opt.match.find == set_find || hit+m.len>eol) && !block_find(ctx,file->buf.buf+bol,eol-bol,&m)){
+                /* the match spans several lines */
+                s.pos = eol;
+                continue;
+            }
+        }else{
+            vars.nmatches = simple_match(&opt.match,ctx,file->buf.buf+bol,eol-bol,vars.matches,OFFSETS_SIZE);
+            if (!vars.nmatches){
+                /* the match spans several lines */
+                scan_skip(file,&s,eol);
+                continue;
+            }
+        }
+        if (file->is_binary){
+            out_binary(file);
+            return 1;
+        }
+        if (plain){
+            if (!file->nmatches){
+                out_hit_header(file);
+                if (opt.show_filename && !opt.heading){
+                    name = file_fullname(file);
+                    namelen = strlen(name);
+                }
+            }
+            out_plain(name,namelen,scan_lineno(file,&s,bol),file->buf.buf+bol,eol-bol);
+            s.pos = eol;
+        }else{
+            scan_skip(file,&s,bol);
+            scan_hit(file,&s,bol,eol);
+        }
+        file->nmatches++;
+        if ((opt.m && (opt.m==file->nmatches))){
+            break;
+        }
+    }
+    return file->nmatches? 1:0;
+}
+
+long block_file(file_t *file,re_ctx_t *ctx) {
+    return block_search(file,ctx,0);
+}
+
+long plain_file(file_t *file,re_ctx_t *ctx) {
+    return block_search(file,ctx,1);
+}
+
+/* the search loop for the options given, picked once before the search starts */
+void analize_select() {
+    if (opt.multiline && !opt.passthru){
+        vars.analize = multiline_file;
+    }else if (opt.passthru){
+        vars.analize = passthru_lines;
+    }else if (!opt.match.find){
+        vars.analize = opt.show_context? analize_lines:count_lines;
+    }else if (opt.v){
+        if (opt.o || opt.column || (opt.show_context && (opt.A || opt.B))){
+            vars.analize = opt.show_context? analize_lines:count_lines;
+        }else{
+            vars.analize = invert_file;
+        }
+    }else if (!opt.show_context){
+        vars.analize = count_file;
+    }else if (opt.A || opt.B || opt.o || opt.column || opt.color || opt.show_pattern){
+        vars.analize = block_file;
+    }else{
+        vars.analize = plain_file;
+    }
+}
+
+long analize_file(file_t *file) {
+#ifdef USE_READ
+    if (opt.passthru){
+        return passthru_file(file);
+    }
+#endif
+    if (file->is_binary && opt.binary != BINARY_MATCHES){
+        /* found by the file type check already */
+        if (opt.binary != BINARY_TEXT){
+            return 0;
+        }
+        file->is_binary = 0;
+    }
+    return vars.analize(file,vars.ctx);
+}
+
+void get_filetypes(file_t *file) {
+    filetype_t *ft;
+    int res;
+    char *type;
+
+    if (file->type_processed)
+        return;
+
+    file->type_processed = 1;
+    res = 0;
+
+    if (!is_searchable(file)){
+        // "skiped"
+        bf_set(file->filetypes,vars.ft_skipped->i);
+        return;
+    }
+
+
+    if ( (type = analyse_internals(file)) ){
         ft = find_filetype(type);
         if (ft){
             res++;
@@ -1479,175 +4997,1955 @@ void get_filetypes(file_t *file) {
         }
     }
 
+    res += name_filetypes(file);
+
+    if (res && !file->is_binary ){
+        bf_set(file->filetypes,vars.ft_text->i);
+    }
+
+    return;
+}
+
+/* the types given by the name of the file, returns how many were found */
+int name_filetypes(file_t *file) {
+    ext_t *ext;
+    filetype_t *ft;
+    int len;
+    int res;
+
+    res = 0;
+    if (0 == FILENAMECMP("makefile",file->name) ||
+            0 == FILENAMECMP("gnumakefile",file->name)){
+        // "make" + "text"
+        bf_set(file->filetypes,vars.ft_make->i);
+        res++;
+    }else if (0==FILENAMECMP("rakefile",file->name)){
+        // "rake", "ruby", "text"
+        ft = find_filetype("rake");
+        bf_set(file->filetypes,ft->i);
+        bf_set(file->filetypes,vars.ft_ruby->i);
+        res++;
+    }
+
+    len = file->namelen;
+
+    LIST_FOREACH(ext,&opt.exts,next){
+        if (_ends_with(file->name,len,ext->ext,ext->len)){
+            bf_set(file->filetypes,ext->type->i);
+            res++;
+        }
+    }
+    return res;
+}
+
+
+int ignore_dir(const char *dirname) {
+    string_t *str;
+    int dirlen;
+
+    dirlen = strlen(dirname);
+
+    LIST_FOREACH(str,&opt.ignore_dirs,next){
+        if ((dirlen == str->len) && FILENAMENCMP(dirname,str->str,str->len)==0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int scandir_ignore_dir(const struct dirent *d) {
+    return !ignore_dir(d->d_name);
+}
+
+
+
+int is_interesting(file_t *file) {
+    get_filetypes(file);
+    return (bf_fast_intersect(file->filetypes,opt.req_filetypes));
+}
+
+/* 0 if search_file() is sure to pass the file by, judging by its name only */
+int name_interesting(file_t *file) {
+    if (!is_searchable(file)){
+        return !opt.a && bf_isset(opt.req_filetypes,vars.ft_skipped->i);
+    }
+    if (opt.a || vars.by_content){
+        return 1;
+    }
+    name_filetypes(file);
+    return bf_fast_intersect(file->filetypes,opt.req_filetypes);
+}
+
+
+int _starts_with(const char *name,int nsize, const char *start,int ssize) {
+    if ((nsize < ssize) || (*name!=*start))
+        return 0;
+    return 0 == FILENAMENCMP(name,start,ssize);
+}
+
+int _ends_with(const char *name,int nsize,const char *ext,int esize) {
+    if (nsize < esize)
+        return 0;
+    {
+        return 0 == FILENAMENCMP(name+nsize-esize,ext,esize);
+    }
+}
+
+int is_searchable(file_t *file) {
+    int len = file->namelen;
+    return !(
+            /* \.bak */_ends_with(file->name,len,".bak",4) ||
+            /* ~$ */_ends_with(file->name,len,"~",1) ||
+            /* [._].*\.swp */ ((_starts_with(file->name,len,".",1) || _starts_with(file->name,len,"_",1)) && _ends_with(file->name,len,".swp",4)) ||
+            /* \.bak$ */ _ends_with(file->name,len,".tmp",4) ||
+            /* #.+#$ */ (_starts_with(file->name,len,"#",1) && _ends_with(file->name,len,"#",1)) ||
+            0/*TODO: (_starts_with(file->name,len,"core.",5))*/
+            );
+}
+
+
+long process_sdtdin(FHANDLE f) {
+    file_t file;
+
+    memset(&file,0,sizeof(file_t));
+    file.fullname = "";
+    file.name = "";
+    file.filetypes = vars.filetypes;
+    bf_reset(file.filetypes);
+    file.f = f;
+    vars.file_processed++;
+    vars.files_matched += analize_file(&file);
+    vars.total_matches += file.nmatches;
+    free(file.buf.buf);
+    return file.nmatches;
+}
+
+
+/* makes data holding the whole file the file buffer */
+void file_attach(file_t *file,char *data,size_t size) {
+    file->rbuf = file->buf;
+    file->buf.buf = data;
+    file->buf.allocated = size;
+    file->buf.used = size;
+    file->buf.start = 0;
+    file->whole = 1;
+}
+
+void file_detach(file_t *file) {
+    if (file->whole){
+        file->buf = file->rbuf;
+        file->buf.start = 0;
+        file->buf.used = 0;
+        file->whole = 0;
+    }
+}
+
+#ifdef USE_READ
+/*
+ * Reads a file of the given size into the file buffer with one read().
+ * One byte more is asked for, so a short read is the EOF and no extra
+ * probe is needed; if the file grew since fstat() it is rewound and
+ * left to read_file().
+ */
+int read_whole(file_t *file,size_t size) {
+    buf_t *b;
+    char *tmp;
+    long res;
+
+    b = &file->buf;
+    if (b->allocated<size+1){
+        tmp = realloc(b->buf,size+1);
+        if (!tmp){
+            return 0;
+        }
+        b->buf = tmp;
+        b->allocated = size+1;
+    }
+    res = FREAD(file->f,b->buf,size+1);
+    if (res<0){
+        return 0;
+    }
+    if ((size_t)res>size){
+        if (lseek(file->f,0,SEEK_SET)<0){
+            /* keep what we've got */
+            b->start = 0;
+            b->used = res;
+        }
+        return 0;
+    }
+    file_attach(file,b->buf,res);
+    return 1;
+}
+
+#ifdef USE_MMAP
+int map_file(file_t *file,size_t size) {
+    void *ptr;
+
+    ptr = mmap(NULL,size,PROT_READ,MAP_PRIVATE,file->f,0);
+    if (ptr == MAP_FAILED){
+        return 0;
+    }
+    madvise(ptr,size,MADV_SEQUENTIAL);
+
+    file_attach(file,ptr,size);
+    file->mapped = 1;
+    return 1;
+}
+#endif
+
+/* loads a regular file in one go, pipes, devices etc. go through read_file() */
+int load_file(file_t *file) {
+    struct stat statbuf;
+
+    if (fstat(file->f,&statbuf)<0 || !S_ISREG(statbuf.st_mode) ||
+            (off_t)(size_t)statbuf.st_size != statbuf.st_size){
+        return 0;
+    }
+#ifdef USE_MMAP
+    if (opt.mmap && statbuf.st_size>=MMAP_THRESHOLD && map_file(file,statbuf.st_size)){
+        return 1;
+    }
+#endif
+    if (statbuf.st_size<=opt.whole_size){
+        return read_whole(file,statbuf.st_size);
+    }
+    return 0;
+}
+#endif
+
+#ifdef USE_ZIP
+typedef struct{
+    const char *magic;
+    int len;
+    const char *ext;
+    char *argv[4];
+}unzip_t;
+
+/* a '?' in magic is the bzip2 block size, '1' to '9' */
+unzip_t unzips[] = {
+    {"\x1f\x8b\x08",3,".gz",{"gzip","-dc",NULL}},
+    {"BZh?\x31\x41\x59\x26\x53\x59",10,".bz2",{"bzip2","-dc",NULL}},
+    {"BZh?\x17\x72\x45\x38\x50\x90",10,".bz2",{"bzip2","-dc",NULL}}, /* empty */
+    {"\xfd" "7zXZ\0",6,".xz",{"xz","-dc",NULL}},
+    {"\x28\xb5\x2f\xfd",4,".zst",{"zstd","-dcq",NULL}},
+};
+
+unzip_t *unzip_find(const char *hdr,long len) {
+    int i;
+    int j;
+
+    for(i=0;i<numberof(unzips);i++){
+        for(j=0;j<unzips[i].len && j<len;j++){
+            if (unzips[i].magic[j] == '?'? hdr[j]<'1' || hdr[j]>'9':hdr[j] != unzips[i].magic[j]){
+                break;
+            }
+        }
+        if (j == unzips[i].len){
+            return &unzips[i];
+        }
+    }
+    return NULL;
+}
+
+#ifdef USE_ZLIB
+/* -z: gzip files are inflated here instead of by a gzip process */
+struct{
+    z_stream z;
+    int zinit;
+    char *buf;
+    int done;
+    int out; /* some data came out */
+    int end; /* a member ended, what follows may be padding */
+    int raw; /* not gzip after all, read as it is */
+}gz;
+
+/* reader of a gzip file, one that fails before any output is read as it is */
+long gz_read(file_t *file,char *buf,long size) {
+    long res;
+    int ret;
+
+    if (gz.raw){
+        return FREAD(file->zf,buf,size);
+    }
+    gz.z.next_out = (Bytef*)buf;
+    gz.z.avail_out = size;
+    while(gz.z.avail_out == size && !gz.done){
+        if (!gz.z.avail_in){
+            res = FREAD(file->zf,gz.buf,BUFFER_SIZE);
+            if (res<=0){
+                if (res<0 || gz.z.total_in){
+                    fprintf(stderr,"%s: %s: Unexpected end of file\n",opt.self_name,file_fullname(file));
+                }
+                gz.done = 1;
+                break;
+            }
+            gz.z.next_in = (Bytef*)gz.buf;
+            gz.z.avail_in = res;
+        }
+        ret = inflate(&gz.z,Z_NO_FLUSH);
+        if (ret == Z_STREAM_END){
+            /* concatenated members */
+            gz.end = 1;
+            inflateReset(&gz.z);
+        }else if (ret != Z_OK && ret != Z_BUF_ERROR){
+            gz.done = 1;
+            if (!gz.out && gz.z.avail_out == size && lseek(file->zf,0,SEEK_SET) == 0){
+                gz.raw = 1;
+                return FREAD(file->zf,buf,size);
+            }
+            if (!gz.end){
+                fprintf(stderr,"%s: %s: %s\n",opt.self_name,file_fullname(file),gz.z.msg? gz.z.msg:"Bad gzip data");
+            }
+        }
+    }
+    gz.out |= gz.z.avail_out != size;
+    return size-gz.z.avail_out;
+}
+
+int gz_open(file_t *file) {
+    if (!gz.buf && !(gz.buf = malloc(BUFFER_SIZE))){
+        return 0;
+    }
+    if (gz.zinit){
+        inflateReset(&gz.z);
+    }else if (inflateInit2(&gz.z,MAX_WBITS+16) == Z_OK){
+        gz.zinit = 1;
+    }else{
+        return 0;
+    }
+    if (lseek(file->f,0,SEEK_SET)<0){
+        return 0;
+    }
+    gz.z.avail_in = 0;
+    gz.done = 0;
+    gz.out = 0;
+    gz.end = 0;
+    gz.raw = 0;
+    file->zf = file->f;
+    file->zpid = -1;
+    file->read = gz_read;
+    return 1;
+}
+#endif
+
+void unzip_free() {
+#ifdef USE_ZLIB
+    if (gz.zinit){
+        inflateEnd(&gz.z);
+    }
+    free(gz.buf);
+    memset(&gz,0,sizeof(gz));
+#endif
+}
+
+/* waits till the decompressor writes or exits, 0 if it exits without output */
+int unzip_output(int fd) {
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while(poll(&pfd,1,-1)<0){
+        if (errno != EINTR){
+            return 1;
+        }
+    }
+    return ioctl(fd,FIONREAD,&n)<0 || n>0;
+}
+
+/* reaps the decompressor, 0 if it failed */
+int unzip_wait(file_t *file) {
+    int status;
+
+    if (file->zpid<=0){
+        return 1;
+    }
+    while(waitpid(file->zpid,&status,0)<0){
+        if (errno != EINTR){
+            file->zpid = -1;
+            return 1;
+        }
+    }
+    file->zpid = -1;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127){
+        fprintf(stderr,"%s: %s: Failed to run the decompressor\n",opt.self_name,file_fullname(file));
+    }
+    return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+/* makes file->f or file->read give the data decompressed by u */
+int unzip_start(file_t *file,unzip_t *u) {
+    int p[2];
+    int pid;
+
+#ifdef USE_ZLIB
+    if (u == unzips){
+        return gz_open(file);
+    }
+#endif
+    if (pipe(p)<0){
+        return 0;
+    }
+    fflush(stdout);
+    pid = fork();
+    if (pid<0){
+        close(p[0]);
+        close(p[1]);
+        return 0;
+    }
+    if (!pid){
+        lseek(file->f,0,SEEK_SET);
+        dup2(file->f,0);
+        dup2(p[1],1);
+        close(p[0]);
+        close(p[1]);
+        execvp(u->argv[0],u->argv);
+        _exit(127);
+    }
+    close(p[1]);
+    file->zf = file->f;
+    file->zpid = pid;
+    file->f = p[0];
+    if (!unzip_output(p[0]) && !unzip_wait(file)){
+        /* not compressed after all, it is searched as it is */
+        close(p[0]);
+        file->f = file->zf;
+        file->zpid = 0;
+        lseek(file->f,0,SEEK_SET);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Starts a decompressor on a compressed file and makes file->f read its
+ * output, so the file is searched block by block as the data comes.
+ * gzip is inflated by file->read without a process. The name loses the
+ * compression suffix for the type checks.
+ */
+int unzip_open(file_t *file) {
+    char hdr[16];
+    long len;
+    unzip_t *u;
+    int elen;
+
+    len = pread(file->f,hdr,sizeof(hdr),0);
+    if (len<=0 || !(u = unzip_find(hdr,len)) || !unzip_start(file,u)){
+        return 0;
+    }
+    elen = strlen(u->ext);
+    if (_ends_with(file->name,file->namelen,u->ext,elen)){
+        file->namelen -= elen;
+    }
+    return 1;
+}
+
+void unzip_close(file_t *file) {
+    if (!file->zpid){
+        return;
+    }
+    if (file->f != file->zf){
+        close(file->f);
+        file->f = file->zf;
+    }
+    file->read = NULL;
+    file->namelen = strlen(file->name);
+    unzip_wait(file);
+    file->zpid = 0;
+}
+#endif
+
+void unload_file(file_t *file) {
+#ifdef USE_MMAP
+    if (file->mapped){
+        munmap(file->buf.buf,file->buf.allocated);
+        file->mapped = 0;
+    }
+#endif
+    file_detach(file);
+}
+
+
+int G_filter(char *name) {
+    if(opt.G.re){
+        if (opt.invert_file_match == simple_match(&opt.G,vars.G_ctx,name,strlen(name),NULL,1)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void file_init(char *fullname,char *name) {
+    vars.file.buf.start = 0;
+    vars.file.buf.used = 0;
+    vars.file.fullname = fullname;
+    vars.file.path = fullname;
+    vars.file.dirname = NULL;
+    vars.file.dirlen = 0;
+#ifdef USE_GETDENTS
+    vars.file.dirfd = AT_FDCWD;
+    vars.file.f = -1;
+#endif
+    vars.file.name = name;
+    vars.file.namelen = strlen(name);
+    vars.file.filetypes = vars.filetypes;
+    vars.file.nmatches = 0;
+    vars.file.line = 0;
+    vars.file.is_binary = 0;
+    vars.file.type_processed = 0;
+
+    bf_reset(vars.file.filetypes);
+}
+
+/* type checks and search of an opened or loaded file */
+void search_file(file_t *file) {
+    if ( /*opt.u ||*/
+            (opt.a && is_searchable(file))||
+            ((!opt.a) && is_interesting(file))
+       ){
+
+        if (opt.f){
+            file->nmatches++;
+            printf("%s",file_fullname(file));
+            if (opt.show_types){
+                filetype_t *ft;
+                int i;
+
+                printf(" => ");
+                i = 0;
+                get_filetypes(file);
+                LIST_FOREACH(ft,&opt.all_filetypes,next){
+                    if (bf_isset(file->filetypes,ft->i)){
+                        if (i){
+                            printf(",");
+                        }
+                        printf("%s",ft->name);
+                        i++;
+                    }
+                }
+            }
+            printf("%s",opt.line_end);
+        }else{
+            get_filetypes(file);
+            analize_file(file);
+            if (file->is_binary && opt.binary == BINARY_SKIP){
+                return;
+            }
+            if (!opt.show_total && (opt.l || opt.c)){
+                if (opt.L){
+                    if (!file->nmatches){
+                        print_count(file_fullname(file),0,opt.line_end,0,opt.show_filename);
+                        vars.files_listed++;
+                    }
+                }else if (file->nmatches){
+                    print_count(file_fullname(file),file->nmatches,opt.line_end,opt.c,opt.show_filename);
+                }else if (opt.print_count0){
+                    print_count(file_fullname(file),file->nmatches,opt.line_end,1,opt.show_filename);
+                }
+            }
+        }
+    }
+}
+
+#ifdef USE_GETDENTS
+/* a file of a directory being walked */
+void file_init_at(int dirfd,const char *dirname,int dirlen,char *name) {
+    file_init(NULL,name);
+    vars.file.path = name;
+    vars.file.dirfd = dirfd;
+    vars.file.dirname = dirname;
+    vars.file.dirlen = dirlen;
+}
+#endif
+
+#ifdef USE_ZIP
+/*
+ * --search-archives: the members of tar and zip archives are searched
+ * one after another while the archive is read once from start to end,
+ * nothing is extracted. A member is read through file->read and printed
+ * as archive!member.
+ */
+#define ARC_TAR 1
+#define ARC_ZIP 2
+
+struct{
+    FHANDLE f;
+    file_t *file; /* the archive, its read hook inflates a .tar.gz */
+    char *buf;
+    long pos;
+    long len;
+    long long left; /* bytes of the current member still to come, -1 if unknown */
+    buf_t name; /* archive!member */
+    size_t prefix; /* length of "archive!" */
+    buf_t tmp; /* long names, extra fields */
+    file_t member;
+#ifdef USE_ZLIB
+    z_stream z;
+    int zinit;
+    int zdone;
+#endif
+}arc;
+
+int archive_kind(const char *hdr,long len) {
+    if (len>=4 && !memcmp(hdr,"PK\3\4",4)){
+        return ARC_ZIP;
+    }
+    if (len>=262 && !memcmp(hdr+257,"ustar",5)){
+        return ARC_TAR;
+    }
+    return 0;
+}
+
+void arc_free() {
+    free(arc.buf);
+    free(arc.name.buf);
+    free(arc.tmp.buf);
+    free(arc.member.buf.buf);
+#ifdef USE_ZLIB
+    if (arc.zinit){
+        inflateEnd(&arc.z);
+    }
+#endif
+    memset(&arc,0,sizeof(arc));
+}
+
+int buf_reserve(buf_t *b,size_t size) {
+    char *tmp;
+
+    if (b->allocated<size){
+        tmp = realloc(b->buf,size);
+        if (!tmp){
+            return 0;
+        }
+        b->buf = tmp;
+        b->allocated = size;
+    }
+    return 1;
+}
+
+int arc_start(file_t *file) {
+    char *name;
+
+    if (!arc.buf && !(arc.buf = malloc(BUFFER_SIZE))){
+        return 0;
+    }
+    name = file_fullname(file);
+    arc.prefix = strlen(name)+1;
+    if (!buf_reserve(&arc.name,arc.prefix+1)){
+        return 0;
+    }
+    memcpy(arc.name.buf,name,arc.prefix-1);
+    arc.name.buf[arc.prefix-1] = '!';
+    arc.f = file->f;
+    arc.file = file;
+    arc.pos = 0;
+    arc.len = 0;
+    return 1;
+}
+
+long arc_in(char *dst,long n) {
+    if (arc.file->read){
+        return arc.file->read(arc.file,dst,n);
+    }
+    return FREAD(arc.f,dst,n);
+}
+
+int arc_fill() {
+    long res;
+
+    if (arc.pos<arc.len){
+        return 1;
+    }
+    res = arc_in(arc.buf,BUFFER_SIZE);
+    arc.pos = 0;
+    arc.len = res>0?res:0;
+    return arc.len>0;
+}
+
+long arc_read(char *dst,long n) {
+    long done;
+    long k;
+
+    done = 0;
+    while(done<n){
+        if (arc.pos == arc.len && n-done>=BUFFER_SIZE){
+            /* big reads skip the archive buffer */
+            k = arc_in(dst+done,n-done);
+            if (k<=0){
+                break;
+            }
+        }else{
+            if (!arc_fill()){
+                break;
+            }
+            k = arc.len-arc.pos;
+            if (k>n-done){
+                k = n-done;
+            }
+            memcpy(dst+done,arc.buf+arc.pos,k);
+            arc.pos += k;
+        }
+        done += k;
+    }
+    return done;
+}
+
+int arc_skip(long long n) {
+    long k;
+
+    k = arc.len-arc.pos;
+    if (k>n){
+        k = n;
+    }
+    arc.pos += k;
+    n -= k;
+    if (!n || (!arc.file->read && lseek(arc.f,n,SEEK_CUR)>=0)){
+        return 1;
+    }
+    /* a pipe or inflated data */
+    while(n && arc_fill()){
+        k = arc.len-arc.pos;
+        if (k>n){
+            k = n;
+        }
+        arc.pos += k;
+        n -= k;
+    }
+    return !n;
+}
+
+/* reader of a stored member */
+long arc_member_read(file_t *file,char *buf,long size) {
+    long res;
+
+    if (size>arc.left){
+        size = arc.left;
+    }
+    res = arc_read(buf,size);
+    arc.left -= res;
+    return res;
+}
+
+#ifdef USE_ZLIB
+/* reader of a deflated zip member */
+long arc_inflate_read(file_t *file,char *buf,long size) {
+    long avail;
+    int res;
+
+    if (arc.zdone){
+        return 0;
+    }
+    arc.z.next_out = (Bytef*)buf;
+    arc.z.avail_out = size;
+    while(arc.z.avail_out == size){
+        avail = arc_fill()?arc.len-arc.pos:0;
+        if (arc.left>=0 && avail>arc.left){
+            avail = arc.left;
+        }
+        if (!avail){
+            /* truncated */
+            arc.zdone = 1;
+            break;
+        }
+        arc.z.next_in = (Bytef*)arc.buf+arc.pos;
+        arc.z.avail_in = avail;
+        res = inflate(&arc.z,Z_NO_FLUSH);
+        avail -= arc.z.avail_in;
+        arc.pos += avail;
+        if (arc.left>=0){
+            arc.left -= avail;
+        }
+        if (res != Z_OK){
+            arc.zdone = 1;
+            if (res != Z_STREAM_END){
+                fprintf(stderr,"%s: %s: %s\n",opt.self_name,arc.name.buf,arc.z.msg?arc.z.msg:"Broken data");
+            }
+            break;
+        }
+    }
+    return size-arc.z.avail_out;
+}
+#endif
+
+/* searches the member at path, its data is read with reader */
+void arc_member(const char *path,size_t len,long (*reader)(file_t*,char*,long)) {
+    file_t *m;
+    char *name;
+
+    if (!buf_reserve(&arc.name,arc.prefix+len+1)){
+        return;
+    }
+    memcpy(arc.name.buf+arc.prefix,path,len);
+    arc.name.buf[arc.prefix+len] = 0;
+    name = strrchr(arc.name.buf+arc.prefix,'/');
+    name = name?name+1:arc.name.buf+arc.prefix;
+    if (!*name || !G_filter(name)){
+        return;
+    }
+
+    m = &arc.member;
+    m->f = arc.f;
+    m->read = reader;
+    m->fullname = arc.name.buf;
+    m->name = name;
+    m->namelen = strlen(name);
+    m->dirname = NULL;
+    m->buf.start = 0;
+    m->buf.used = 0;
+    m->filetypes = vars.filetypes;
+    m->nmatches = 0;
+    m->line = 0;
+    m->is_binary = 0;
+    m->type_processed = 0;
+    bf_reset(m->filetypes);
+
+    vars.file_processed++;
+    search_file(m);
+    vars.files_matched += m->nmatches;
+    vars.total_matches += m->nmatches;
+}
+
+long long tar_number(const unsigned char *p,int n) {
+    long long v;
+
+    v = 0;
+    if (*p & 0x80){
+        /* base-256 */
+        v = *p & 0x3f;
+        while(--n){
+            v = (v<<8)|*++p;
+        }
+        return v;
+    }
+    while(n && *p == ' '){
+        p++;
+        n--;
+    }
+    while(n && *p>='0' && *p<='7'){
+        v = v*8+*p-'0';
+        p++;
+        n--;
+    }
+    return v;
+}
+
+/* "len key=value\n" records of a pax header, the path is put into arc.tmp */
+int pax_path(char *data,long len,long *plen) {
+    char *end;
+    char *rec;
+    long rlen;
+
+    end = data+len;
+    while(data<end){
+        rlen = strtol(data,&rec,10);
+        if (rlen<=0 || rlen>end-data || *rec != ' '){
+            break;
+        }
+        rec++;
+        if (!strncmp(rec,"path=",5)){
+            *plen = data+rlen-1-(rec+5);
+            memmove(arc.tmp.buf,rec+5,*plen);
+            return 1;
+        }
+        data += rlen;
+    }
+    return 0;
+}
+
+void tar_search(unsigned char *hdr) {
+    long long size;
+    long pad;
+    long plen;
+    int type;
+    int longname;
+    char *path;
+
+    longname = 0;
+    plen = 0;
+    while(hdr[0] && !(opt.one && vars.total_matches)){
+        size = tar_number(hdr+124,12);
+        pad = (512-size%512)%512;
+        type = hdr[156];
+        if ((type == 'L' || type == 'x') && size<1024*1024){
+            /* GNU long name or pax header for the next member */
+            if (!buf_reserve(&arc.tmp,size+1) || arc_read(arc.tmp.buf,size) != size){
+                break;
+            }
+            arc.tmp.buf[size] = 0;
+            if (type == 'L'){
+                plen = strlen(arc.tmp.buf);
+                longname = 1;
+            }else if (pax_path(arc.tmp.buf,size,&plen)){
+                longname = 1;
+            }
+            arc_skip(pad);
+        }else if (type == '0' || type == 0 || type == '7'){
+            if (longname){
+                path = arc.tmp.buf;
+            }else{
+                /* ustar prefix and name */
+                if (!buf_reserve(&arc.tmp,257)){
+                    break;
+                }
+                path = arc.tmp.buf;
+                plen = strnlen((char*)hdr+345,155);
+                memcpy(path,hdr+345,plen);
+                if (plen){
+                    path[plen++] = '/';
+                }
+                memcpy(path+plen,hdr,strnlen((char*)hdr,100));
+                plen += strnlen((char*)hdr,100);
+            }
+            arc.left = size;
+            arc_member(path,plen,arc_member_read);
+            arc_skip(arc.left+pad);
+            longname = 0;
+        }else{
+            arc_skip(size+pad);
+            if (type != 'g'){
+                longname = 0;
+            }
+        }
+        if (arc_read((char*)hdr,512) != 512){
+            break;
+        }
+    }
+}
 
-    if (0 == FILENAMECMP("makefile",file->name) ||
-            0 == FILENAMECMP("gnumakefile",file->name)){
-        // "make" + "text"
-        bf_set(file->filetypes,vars.ft_make->i);
-        res++;
-    }else if (0==FILENAMECMP("rakefile",file->name)){
-        // "rake", "ruby", "text"
-        ft = find_filetype("rake");
-        bf_set(file->filetypes,ft->i);
-        bf_set(file->filetypes,vars.ft_ruby->i);
-        res++;
+unsigned int le16(const unsigned char *p) {
+    return p[0]|(p[1]<<8);
+}
+
+unsigned long le32(const unsigned char *p) {
+    return le16(p)|((unsigned long)le16(p+2)<<16);
+}
+
+void zip_search() {
+    unsigned char h[30];
+    unsigned char *x;
+    unsigned char *end;
+    int k;
+    int flags;
+    int method;
+    long long csize;
+    long nlen;
+    long xlen;
+
+    while(!(opt.one && vars.total_matches) && arc_read((char*)h,30) == 30 && !memcmp(h,"PK\3\4",4)){
+        flags = le16(h+6);
+        method = le16(h+8);
+        csize = le32(h+18);
+        nlen = le16(h+26);
+        xlen = le16(h+28);
+        if (!buf_reserve(&arc.tmp,nlen+xlen+1) || arc_read(arc.tmp.buf,nlen+xlen) != nlen+xlen){
+            break;
+        }
+        if (csize == 0xffffffff){
+            /* zip64 extra field, the original size comes first if it's there too */
+            x = (unsigned char*)arc.tmp.buf+nlen;
+            end = x+xlen;
+            for(;x+4<=end;x += 4+le16(x+2)){
+                k = le32(h+22) == 0xffffffff?8:0;
+                if (le16(x) == 1 && x+4+k+8<=end){
+                    csize = le32(x+4+k)|((long long)le32(x+8+k)<<32);
+                    break;
+                }
+            }
+        }
+        arc.left = (flags & 8)?-1:csize;
+        if ((flags & 8) && method != 8){
+            fprintf(stderr,"%s: %s: Can't stream the members after %.*s\n",opt.self_name,file_fullname(&vars.file),(int)nlen,arc.tmp.buf);
+            break;
+        }
+        if ((flags & 1) || (nlen && arc.tmp.buf[nlen-1] == '/')){
+            /* encrypted or a directory */
+        }else if (method == 0){
+            arc_member(arc.tmp.buf,nlen,arc_member_read);
+        }else if (method == 8){
+#ifdef USE_ZLIB
+            if (arc.zinit){
+                inflateReset(&arc.z);
+            }else if (inflateInit2(&arc.z,-MAX_WBITS) == Z_OK){
+                arc.zinit = 1;
+            }else{
+                break;
+            }
+            arc.zdone = 0;
+            arc_member(arc.tmp.buf,nlen,arc_inflate_read);
+            if (arc.left<0){
+                /* the end is known only to inflate */
+                if (!buf_reserve(&arc.tmp,BUFFER_SIZE)){
+                    break;
+                }
+                while(arc_inflate_read(NULL,arc.tmp.buf,BUFFER_SIZE)>0){
+                }
+            }
+#else
+            if (arc.left<0){
+                break;
+            }
+#endif
+        }else if (arc.left<0){
+            break;
+        }
+        if (arc.left>0){
+            arc_skip(arc.left);
+        }
+        if (flags & 8){
+            /* data descriptor, the signature is optional */
+            if (arc_read((char*)h,4) != 4){
+                break;
+            }
+            arc_skip(memcmp(h,"PK\7\b",4)?8:12);
+        }
     }
+}
 
-    len = file->namelen;
+/* a compressed file is unpacked to look for a tar only if its name says it is one */
+int is_tarname(file_t *file) {
+    static const char *exts[] = {".tgz",".taz",".tbz",".tbz2",".txz",".tzst",NULL};
+    int i;
 
-    LIST_FOREACH(ext,&opt.exts,next){
-        if (_ends_with(file->name,len,ext->ext,ext->len)){
-            bf_set(file->filetypes,ext->type->i);
-            res++;
+    for(i=0;exts[i];i++){
+        if (_ends_with(file->name,file->namelen,exts[i],strlen(exts[i]))){
+            return 1;
         }
     }
+    return strstr(file->name,".tar.") != NULL;
+}
 
-    if (res && !file->is_binary ){
-        bf_set(file->filetypes,vars.ft_text->i);
+/* searches file as an archive, also a compressed tar */
+int search_archive(file_t *file) {
+    char hdr[512];
+    long len;
+    int kind;
+
+    len = pread(file->f,hdr,sizeof(hdr),0);
+    if (len<4){
+        return 0;
+    }
+    kind = archive_kind(hdr,len);
+    if (!kind && !(is_tarname(file) && unzip_find(hdr,len))){
+        return 0;
+    }
+    if (!arc_start(file)){
+        return 0;
+    }
+    if (kind == ARC_ZIP){
+        zip_search();
+        return 1;
+    }
+    if (kind == ARC_TAR){
+        arc_read(hdr,512);
+        tar_search((unsigned char*)hdr);
+        return 1;
+    }
+    if (!unzip_open(file)){
+        return 0;
+    }
+    arc.f = file->f;
+    len = arc_read(hdr,512);
+    if (archive_kind(hdr,len) != ARC_TAR){
+        unzip_close(file);
+        lseek(file->f,0,SEEK_SET);
+        return 0;
+    }
+    tar_search((unsigned char*)hdr);
+    unzip_close(file);
+    return 1;
+}
+#endif
+
+/* opens, searches and closes the file set up by file_init() */
+long file_process() {
+#ifdef USE_GETDENTS
+    if (vars.file.f<0){
+        vars.file.f = openat(vars.file.dirfd,vars.file.path,O_RDONLY|O_CLOEXEC);
+    }
+#else
+    vars.file.f = FOPEN(vars.file.path);
+#endif
+    vars.file_processed++;
+    if (FISGOOD(vars.file.f)){
+#ifdef USE_ZIP
+        if (opt.archives && search_archive(&vars.file)){
+            /* the members are searched and counted one by one */
+        }else if (opt.z && !opt.f && unzip_open(&vars.file)){
+            search_file(&vars.file);
+            unzip_close(&vars.file);
+        }else
+#endif
+        {
+#ifdef USE_READ
+            /* --passthru copies the fd itself, mapping it first only costs */
+            if (!opt.f && !opt.passthru){
+                load_file(&vars.file);
+            }
+#endif
+            search_file(&vars.file);
+            unload_file(&vars.file);
+        }
+        FCLOSE(vars.file.f);
+    }else{
+        fprintf(stderr,"%s: %s: Failed to open %d:%s\n",opt.self_name,file_fullname(&vars.file),errno,strerror(errno));
+    }
+    vars.files_matched += vars.file.nmatches;
+    vars.total_matches += vars.file.nmatches;
+    return vars.file.nmatches;
+
+}
+
+long process_file(char *fullname,char *name) {
+    file_init(fullname,name);
+    return file_process();
+}
+
+#ifdef USE_GETDENTS
+/* fd is the file already opened or -1 */
+long process_file_at(int dirfd,const char *dirname,int dirlen,char *name,int fd) {
+    file_init_at(dirfd,dirname,dirlen,name);
+    vars.file.f = fd;
+    return file_process();
+}
+#endif
+
+
+/*
+ * ===========================================================================
+ * io_uring batch loader
+ * ===========================================================================
+ */
+
+#ifdef USE_URING
+
+typedef struct{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    int plain_fds; /* openat gave plain fds, no direct descriptors in this kernel */
+}uring_t;
+
+typedef struct{
+    char *name;
+    int open_res;
+    int read_res;
+    int big; /* too big for the batch or not plain, searched with process_file_at() */
+    int fd; /* the big file opened ahead for --prefetch, -1 if not */
+}batch_entry_t;
+
+/* files of one directory waiting to be loaded */
+struct{
+    int active;
+    int n;
+    int dirfd;
+    const char *dirname;
+    int dirlen;
+    batch_entry_t *entries;
+    char *bufs;
+    int ahead; /* next entry to prefetch */
+    int nahead; /* big files opened ahead */
+    uring_t ring;
+}batch;
+
+
+void uring_free(uring_t *ring) {
+    if (ring->sqes){
+        munmap(ring->sqes,ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring){
+        munmap(ring->cq_ring,ring->cq_ring_size);
+    }
+    if (ring->sq_ring){
+        munmap(ring->sq_ring,ring->sq_ring_size);
+    }
+    if (ring->fd>=0){
+        close(ring->fd);
+    }
+    memset(ring,0,sizeof(uring_t));
+    ring->fd = -1;
+}
+
+int uring_setup(uring_t *ring,unsigned entries,unsigned nfiles) {
+    struct io_uring_params p;
+    char *sq;
+    char *cq;
+    int *fds;
+    int res;
+    unsigned i;
+
+    memset(ring,0,sizeof(uring_t));
+    memset(&p,0,sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup,entries,&p);
+    if (ring->fd<0){
+        ring->fd = -1;
+        return 0;
+    }
+    fcntl(ring->fd,F_SETFD,FD_CLOEXEC);
+
+    ring->sq_ring_size = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        if (ring->cq_ring_size>ring->sq_ring_size){
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL,ring->sq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED){
+        ring->sq_ring = NULL;
+        goto error;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        ring->cq_ring = ring->sq_ring;
+    }else{
+        ring->cq_ring = mmap(NULL,ring->cq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED){
+            ring->cq_ring = NULL;
+            goto error;
+        }
+    }
+    ring->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL,ring->sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED){
+        ring->sqes = NULL;
+        goto error;
+    }
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq+p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq+p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq+p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq+p.sq_off.array);
+    ring->cq_head = (unsigned*)(cq+p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq+p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq+p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+
+    /* empty table for the direct descriptors */
+    fds = malloc(nfiles*sizeof(int));
+    if (!fds){
+        goto error;
+    }
+    for(i=0;i<nfiles;i++){
+        fds[i] = -1;
+    }
+    res = syscall(__NR_io_uring_register,ring->fd,IORING_REGISTER_FILES,fds,nfiles);
+    free(fds);
+    if (res<0){
+        goto error;
+    }
+    return 1;
+
+error:
+    uring_free(ring);
+    return 0;
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *ring,unsigned *tail) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    idx = (*tail) & (*ring->sq_mask);
+    ring->sq_array[idx] = idx;
+    (*tail)++;
+    sqe = &ring->sqes[idx];
+    memset(sqe,0,sizeof(*sqe));
+    return sqe;
+}
+
+/*
+ * Opens and reads the queued files, one openat and one read per file,
+ * all submitted and reaped with a single io_uring_enter() when possible.
+ * Opened files live in the direct descriptor table, the next openat into
+ * the same slot closes them. A kernel older than 5.15 (built with the
+ * 5.19+ headers USE_URING asks for) ignores the slot and returns a plain
+ * fd, that one is closed here and the read fails.
+ */
+int uring_load(uring_t *ring,int dirfd,batch_entry_t *entries,int n,char *bufs) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    batch_entry_t *e;
+    unsigned tail;
+    unsigned head;
+    int submit;
+    int done;
+    int res;
+    int i;
+
+    tail = *ring->sq_tail;
+    for(i=0;i<n;i++){
+        e = &entries[i];
+        e->open_res = e->read_res = -ECANCELED;
+
+        sqe = uring_sqe(ring,&tail);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dirfd;
+        sqe->addr = (unsigned long)e->name;
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = i+1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = i*2;
+
+        sqe = uring_sqe(ring,&tail);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = i;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = (unsigned long)(bufs+(long)i*URING_READ_SIZE);
+        sqe->len = URING_READ_SIZE;
+        sqe->off = 0;
+        sqe->user_data = i*2+1;
+    }
+    __atomic_store_n(ring->sq_tail,tail,__ATOMIC_RELEASE);
+
+    submit = n*2;
+    done = 0;
+    while(done<n*2){
+        res = syscall(__NR_io_uring_enter,ring->fd,submit,n*2-done,IORING_ENTER_GETEVENTS,NULL,0);
+        if (res<0){
+            if (errno == EINTR){
+                continue;
+            }
+            return 0;
+        }
+        submit -= res;
+
+        head = *ring->cq_head;
+        while(head != __atomic_load_n(ring->cq_tail,__ATOMIC_ACQUIRE)){
+            cqe = &ring->cqes[head & (*ring->cq_mask)];
+            e = &entries[cqe->user_data/2];
+            if (cqe->user_data & 1){
+                e->read_res = cqe->res;
+            }else{
+                e->open_res = cqe->res;
+                if (cqe->res>0){
+                    close(cqe->res);
+                    ring->plain_fds = 1;
+                }
+            }
+            head++;
+            done++;
+        }
+        __atomic_store_n(ring->cq_head,head,__ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+void batch_init() {
+    batch.n = 0;
+    batch.active = 0;
+    if (!opt.uring){
+        return;
+    }
+    batch.entries = malloc(URING_WINDOW*sizeof(batch_entry_t));
+    batch.bufs = malloc((long)URING_WINDOW*URING_READ_SIZE);
+    if (batch.entries && batch.bufs && uring_setup(&batch.ring,URING_WINDOW*2,URING_WINDOW)){
+        batch.active = 1;
+    }else{
+        free(batch.entries);
+        free(batch.bufs);
+        batch.entries = NULL;
+        batch.bufs = NULL;
+    }
+}
+
+void batch_free() {
+    if (batch.active){
+        uring_free(&batch.ring);
+        free(batch.entries);
+        free(batch.bufs);
+        batch.active = 0;
+    }
+}
+
+/* --prefetch: the big files after entry i are opened ahead and handed to posix_fadvise(WILLNEED) */
+void batch_prefetch(int i) {
+    batch_entry_t *e;
+
+    if (batch.ahead<=i){
+        batch.ahead = i+1;
+    }
+    while(batch.nahead<opt.prefetch && batch.ahead<batch.n){
+        e = &batch.entries[batch.ahead++];
+        if (!e->big){
+            continue;
+        }
+        e->fd = openat(batch.dirfd,e->name,O_RDONLY|O_CLOEXEC);
+        if (e->fd>=0){
+            posix_fadvise(e->fd,0,0,POSIX_FADV_WILLNEED);
+            batch.nahead++;
+        }
+    }
+}
+
+void batch_flush() {
+    batch_entry_t *e;
+    int loaded;
+    int i;
+
+    if (!batch.n){
+        return;
+    }
+    loaded = uring_load(&batch.ring,batch.dirfd,batch.entries,batch.n,batch.bufs);
+
+    for(i=0;i<batch.n;i++){
+        e = &batch.entries[i];
+        e->fd = -1;
+        /* not a plain small file, it is done the usual way */
+        e->big = !loaded || (e->open_res>=0 && (e->read_res<0 || e->read_res == URING_READ_SIZE ||
+                ((opt.z || opt.archives) && unzip_find(batch.bufs+(long)i*URING_READ_SIZE,e->read_res)) ||
+                (opt.archives && archive_kind(batch.bufs+(long)i*URING_READ_SIZE,e->read_res))));
+    }
+    batch.ahead = 0;
+    batch.nahead = 0;
+
+    for(i=0;(i<batch.n) && !(opt.one && vars.total_matches);i++){
+        e = &batch.entries[i];
+        if (e->big){
+            if (opt.prefetch){
+                batch_prefetch(i);
+                batch.nahead -= e->fd>=0;
+            }
+            process_file_at(batch.dirfd,batch.dirname,batch.dirlen,e->name,e->fd);
+            e->fd = -1;
+        }else if (e->open_res<0){
+            vars.file_processed++;
+            fprintf(stderr,"%s: %s: Failed to open %d:%s\n",opt.self_name,path_join(batch.dirname,batch.dirlen,e->name),-e->open_res,strerror(-e->open_res));
+        }else{
+            file_init_at(batch.dirfd,batch.dirname,batch.dirlen,e->name);
+            vars.file_processed++;
+            file_attach(&vars.file,batch.bufs+(long)i*URING_READ_SIZE,e->read_res);
+            search_file(&vars.file);
+            file_detach(&vars.file);
+            vars.files_matched += vars.file.nmatches;
+            vars.total_matches += vars.file.nmatches;
+        }
+    }
+    for(;i<batch.n;i++){
+        if (batch.entries[i].fd>=0){
+            close(batch.entries[i].fd);
+        }
+    }
+    batch.n = 0;
+    if (batch.ring.plain_fds){
+        /* the files of this batch were read the usual way, so will the rest */
+        batch_free();
+    }
+}
+
+#endif
+
+#ifdef USE_GETDENTS
+/*
+ * Queues a file for the batch loader or processes it right away.
+ * The name must stay valid till batch_flush(), all queued files
+ * come from one directory. Only regular files are queued, the files
+ * the type filters skip by name are not opened at all.
+ */
+void batch_add(int dirfd,const char *dirname,int dirlen,char *name,int regular) {
+    file_init_at(dirfd,dirname,dirlen,name);
+    if (!name_interesting(&vars.file)){
+        vars.file_processed++;
+        return;
+    }
+#ifdef USE_URING
+    if (batch.active && regular){
+        batch.dirfd = dirfd;
+        batch.dirname = dirname;
+        batch.dirlen = dirlen;
+        batch.entries[batch.n].name = name;
+        batch.n++;
+        if (batch.n == URING_WINDOW){
+            batch_flush();
+        }
+        return;
+    }
+#endif
+    process_file_at(dirfd,dirname,dirlen,name,-1);
+}
+
+int batch_on() {
+#ifdef USE_URING
+    return batch.active;
+#else
+    return 0;
+#endif
+}
+#endif
+
+
+/*
+ * ===========================================================================
+ * directory walker
+ * ===========================================================================
+ */
+
+/* strips the trailing separator of a directory name given by the user */
+void strip_dirsep(char *dirname) {
+    int i;
+
+    i = strlen(dirname);
+    if (i){
+        i--;
+    }
+    if(dirname[i] == DIRSEPC){
+        dirname[i] = 0;
+    }
+}
+
+#ifdef USE_GETDENTS
+
+struct linux_dirent64{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* entries of one directory: type byte, name and NUL packed one after another */
+typedef struct{
+    buf_t names;
+    size_t *index;
+    size_t nindex;
+    size_t aindex;
+}dir_level_t;
+
+/* a directory being walked */
+typedef struct{
+    int fd;
+    size_t i; /* next entry */
+    size_t pathlen; /* walker.path up to this directory */
+    int sep; /* entries are joined to the path with a separator */
+    dev_t dev;
+    ino_t ino;
+}dir_frame_t;
+
+struct{
+    char *dents;
+    dir_level_t **levels;
+    int nlevels;
+    char *sort_base;
+    dir_frame_t *frames;
+    int nframes;
+    buf_t path; /* printable path of the deepest directory */
+}walker;
+
+void walker_free() {
+    int i;
+
+    for(i=0;i<walker.nlevels;i++){
+        free(walker.levels[i]->names.buf);
+        free(walker.levels[i]->index);
+        free(walker.levels[i]);
+    }
+    free(walker.levels);
+    free(walker.dents);
+    free(walker.frames);
+    free(walker.path.buf);
+    memset(&walker,0,sizeof(walker));
+}
+
+/* entry lists are kept per depth and reused for every directory on that depth */
+dir_level_t *walker_level(int depth) {
+    dir_level_t **tmp;
+
+    while(walker.nlevels<=depth){
+        tmp = realloc(walker.levels,(walker.nlevels+1)*sizeof(dir_level_t*));
+        if (!tmp){
+            return NULL;
+        }
+        walker.levels = tmp;
+        walker.levels[walker.nlevels] = calloc(1,sizeof(dir_level_t));
+        if (!walker.levels[walker.nlevels]){
+            return NULL;
+        }
+        walker.nlevels++;
     }
-
-    return;
+    return walker.levels[depth];
 }
 
+int level_add(dir_level_t *lvl,unsigned char type,const char *name) {
+    size_t len;
+    size_t size;
+    char *tmp;
+    size_t *itmp;
 
-int ignore_dir(const char *dirname) {
-    string_t *str;
-    int dirlen;
+    len = strlen(name)+2;
+    if (lvl->names.used+len>lvl->names.allocated){
+        size = (lvl->names.allocated+len)*2;
+        tmp = realloc(lvl->names.buf,size);
+        if (!tmp){
+            return 0;
+        }
+        lvl->names.buf = tmp;
+        lvl->names.allocated = size;
+    }
+    if (lvl->nindex == lvl->aindex){
+        size = lvl->aindex? lvl->aindex*2:256;
+        itmp = realloc(lvl->index,size*sizeof(size_t));
+        if (!itmp){
+            return 0;
+        }
+        lvl->index = itmp;
+        lvl->aindex = size;
+    }
+    lvl->index[lvl->nindex++] = lvl->names.used;
+    lvl->names.buf[lvl->names.used] = type;
+    memcpy(&lvl->names.buf[lvl->names.used+1],name,len-1);
+    lvl->names.used += len;
+    return 1;
+}
 
-    dirlen = strlen(dirname);
+/* --sort-files: the order of alphasort(), which compares with strcoll() */
+int level_cmp(const void *a,const void *b) {
+    return strcoll(walker.sort_base+*(size_t*)a+1,walker.sort_base+*(size_t*)b+1);
+}
 
-    LIST_FOREACH(str,&opt.ignore_dirs,next){
-        if ((dirlen == str->len) && FILENAMENCMP(dirname,str->str,str->len)==0) {
-            return 1;
+/* reads the whole directory with big getdents64 calls */
+int read_dir(int fd,dir_level_t *lvl) {
+    struct linux_dirent64 *d;
+    long n;
+    long off;
+
+    lvl->names.used = 0;
+    lvl->nindex = 0;
+    while((n = syscall(SYS_getdents64,fd,walker.dents,DENTS_SIZE))>0){
+        for(off=0;off<n;off+=d->d_reclen){
+            d = (struct linux_dirent64*)(walker.dents+off);
+            if (d->d_name[0] == '.' && (!d->d_name[1] || (d->d_name[1] == '.' && !d->d_name[2]))){
+                continue;
+            }
+            if (!opt.u && ignore_dir(d->d_name)){
+                continue;
+            }
+            if (!level_add(lvl,d->d_type,d->d_name)){
+                errno = ENOMEM;
+                return -1;
+            }
         }
     }
+    if (n<0){
+        return -1;
+    }
+    if (opt.sort_files){
+        walker.sort_base = lvl->names.buf;
+        qsort(lvl->index,lvl->nindex,sizeof(size_t),level_cmp);
+    }
     return 0;
 }
 
-int scandir_ignore_dir(const struct dirent *d) {
-    return !ignore_dir(d->d_name);
+unsigned char mode2dtype(mode_t mode) {
+    if (S_ISDIR(mode)){
+        return DT_DIR;
+    }
+    if (S_ISLNK(mode)){
+        return DT_LNK;
+    }
+    return DT_REG;
 }
 
+/* sets walker.path to the first len bytes of it followed by name */
+int path_set(size_t len,int sep,const char *name) {
+    size_t nlen;
+    size_t size;
+    char *tmp;
 
-
-int is_interesting(file_t *file) {
-    get_filetypes(file);
-    return (bf_fast_intersect(file->filetypes,opt.req_filetypes));
+    nlen = strlen(name);
+    size = len+nlen+2;
+    if (walker.path.allocated<size){
+        tmp = realloc(walker.path.buf,size*2);
+        if (!tmp){
+            return 0;
+        }
+        walker.path.buf = tmp;
+        walker.path.allocated = size*2;
+    }
+    if (sep){
+        walker.path.buf[len++] = DIRSEPC;
+    }
+    memcpy(&walker.path.buf[len],name,nlen+1);
+    walker.path.used = len+nlen;
+    return 1;
 }
 
+/* reads the directory opened as fd into the frame at depth, walker.path is its name */
+int walker_push(int depth,int fd,int sep) {
+    dir_frame_t *tmp;
+    dir_frame_t *f;
+    struct stat statbuf;
+    dir_level_t *lvl;
 
-int _starts_with(const char *name,int nsize, const char *start,int ssize) {
-    if ((nsize < ssize) || (*name!=*start))
+    if (walker.nframes<=depth){
+        tmp = realloc(walker.frames,(depth+16)*sizeof(dir_frame_t));
+        if (!tmp){
+            errno = ENOMEM;
+            return 0;
+        }
+        walker.frames = tmp;
+        walker.nframes = depth+16;
+    }
+    lvl = walker_level(depth);
+    if (!lvl){
+        errno = ENOMEM;
         return 0;
-    return 0 == FILENAMENCMP(name,start,ssize);
-}
-
-int _ends_with(const char *name,int nsize,const char *ext,int esize) {
-    if (nsize < esize)
+    }
+    if (read_dir(fd,lvl)<0){
         return 0;
-    {
-        return 0 == FILENAMENCMP(name+nsize-esize,ext,esize);
     }
+    f = &walker.frames[depth];
+    f->fd = fd;
+    f->i = 0;
+    f->pathlen = walker.path.used;
+    f->sep = sep;
+    f->dev = 0;
+    f->ino = 0;
+    if (opt.follow && fstat(fd,&statbuf) == 0){
+        f->dev = statbuf.st_dev;
+        f->ino = statbuf.st_ino;
+    }
+    return 1;
 }
 
-int is_searchable(file_t *file) {
-    int len = file->namelen;
-    return !(
-            /* \.bak */_ends_with(file->name,len,".bak",4) ||
-            /* ~$ */_ends_with(file->name,len,"~",1) ||
-            /* [._].*\.swp */ ((_starts_with(file->name,len,".",1) || _starts_with(file->name,len,"_",1)) && _ends_with(file->name,len,".swp",4)) ||
-            /* \.bak$ */ _ends_with(file->name,len,".tmp",4) ||
-            /* #.+#$ */ (_starts_with(file->name,len,"#",1) && _ends_with(file->name,len,"#",1)) ||
-            0/*TODO: (_starts_with(file->name,len,"core.",5))*/
-            );
+/*
+ * Regular files following the current one in its directory are opened
+ * ahead and handed to posix_fadvise(WILLNEED), so the disk reads them
+ * while the current one is searched. The queue belongs to one frame and
+ * is dropped when the walker enters or leaves a directory.
+ */
+struct{
+    int depth;
+    size_t next; /* next entry to look at */
+    int n;
+    int head;
+    size_t *idx;
+    int *fds;
+}prefetch;
+
+void prefetch_drop() {
+    while(prefetch.n){
+        close(prefetch.fds[prefetch.head]);
+        prefetch.head = (prefetch.head+1)%opt.prefetch;
+        prefetch.n--;
+    }
+    prefetch.head = 0;
+    prefetch.depth = -1;
 }
 
+void prefetch_free() {
+    prefetch_drop();
+    free(prefetch.idx);
+    free(prefetch.fds);
+    prefetch.idx = NULL;
+    prefetch.fds = NULL;
+}
 
-long process_sdtdin(FHANDLE f) {
-    file_t file;
-
-    memset(&file,0,sizeof(file_t));
-    file.fullname = "";
-    file.name = "";
-    file.filetypes = vars.filetypes;
-    bf_reset(file.filetypes);
-    file.f = f;
-    vars.file_processed++;
-    vars.files_matched += analize_file(&file);
-    vars.total_matches += file.nmatches;
-    free(file.buf.buf);
-    return file.nmatches;
+/* tops the queue up with the files after entry i of the frame at depth */
+void prefetch_fill(int depth,size_t i) {
+    dir_frame_t *f;
+    dir_level_t *lvl;
+    char *name;
+    size_t off;
+    int fd;
+
+    if (!prefetch.fds){
+        prefetch.idx = malloc(opt.prefetch*sizeof(size_t));
+        prefetch.fds = malloc(opt.prefetch*sizeof(int));
+        if (!prefetch.idx || !prefetch.fds){
+            opt.prefetch = 0;
+            return;
+        }
+        prefetch.n = 0;
+        prefetch.depth = -1;
+    }
+    if (prefetch.depth != depth){
+        prefetch_drop();
+        prefetch.depth = depth;
+        prefetch.next = i;
+    }
+    if (prefetch.next<i){
+        prefetch.next = i;
+    }
+    f = &walker.frames[depth];
+    lvl = walker.levels[depth];
+    while(prefetch.n<opt.prefetch && prefetch.next<lvl->nindex){
+        off = lvl->index[prefetch.next++];
+        name = &lvl->names.buf[off+1];
+        if (lvl->names.buf[off] != DT_REG || !G_filter(name)){
+            continue;
+        }
+        fd = openat(f->fd,name,O_RDONLY|O_CLOEXEC);
+        if (fd<0){
+            continue;
+        }
+        posix_fadvise(fd,0,0,POSIX_FADV_WILLNEED);
+        prefetch.idx[(prefetch.head+prefetch.n)%opt.prefetch] = prefetch.next-1;
+        prefetch.fds[(prefetch.head+prefetch.n)%opt.prefetch] = fd;
+        prefetch.n++;
+    }
 }
 
+/* the prefetched fd of entry i or -1 */
+int prefetch_take(size_t i) {
+    int fd;
 
-long process_file(char *fullname,char *name) {
+    while(prefetch.n && prefetch.idx[prefetch.head]<=i){
+        fd = prefetch.fds[prefetch.head];
+        prefetch.head = (prefetch.head+1)%opt.prefetch;
+        prefetch.n--;
+        if (prefetch.idx[(prefetch.head+opt.prefetch-1)%opt.prefetch] == i){
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
 
-    vars.file.buf.start = 0;
-    vars.file.buf.used = 0;
-    vars.file.fullname = fullname;
-    vars.file.name = name;
-    vars.file.namelen = strlen(name);
-    vars.file.filetypes = vars.filetypes;
-    vars.file.nmatches = 0;
-    vars.file.line = 0;
-    vars.file.is_binary = 0;
-    vars.file.type_processed = 0;
+/*
+ * Iterative walk over the tree. Every directory on the way stays open,
+ * entries are opened and stat()ed relative to it with openat()/fstatat(),
+ * so the kernel never resolves a full path. d_type tells what an entry is,
+ * fstatat() is only needed if the file system doesn't fill it or a symlink
+ * has to be followed. Printable names are made only for files with output.
+ */
+void process_dir(char *dirname) {
+    struct stat statbuf;
+    dir_frame_t *f;
+    dir_level_t *lvl;
+    const char *dname;
+    unsigned char type;
+    char *name;
+    size_t off;
+    int depth;
+    int fd;
+    int i;
 
-    bf_reset(vars.file.filetypes);
-    vars.file.f = FOPEN(vars.file.fullname);
-    vars.file_processed++;
-    if (FISGOOD(vars.file.f)){
+    if (!walker.dents){
+        walker.dents = malloc(DENTS_SIZE);
+        if (!walker.dents){
+            fprintf(stderr,"%s: "__FILE__":"STR(__LINE__)" OOM\n",opt.self_name);
+            return;
+        }
+    }
+    fd = open(dirname,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    strip_dirsep(dirname);
+    /* entries of . are printed without ./ */
+    walker.path.used = 0;
+    if (fd<0 || !path_set(0,0,strcmp(dirname,".")? dirname:"") || !walker_push(0,fd,strcmp(dirname,".")!=0)){
+        fprintf(stderr, "%s: Failed to open directory %s: %s\n", opt.self_name,dirname,
+                strerror(errno));
+        if (fd>=0){
+            close(fd);
+        }
+        return;
+    }
 
-        if ( /*opt.u ||*/
-                (opt.a && is_searchable(&vars.file))||
-                ((!opt.a) && is_interesting(&vars.file))
-           ){
-
-            if (opt.f){
-                vars.file.nmatches++;
-                printf("%s",vars.file.fullname);
-                if (opt.show_types){
-                    filetype_t *ft;
-                    int i;
-
-                    printf(" => ");
-                    i = 0;
-                    get_filetypes(&vars.file);
-                    LIST_FOREACH(ft,&opt.all_filetypes,next){
-                        if (bf_isset(vars.file.filetypes,ft->i)){
-                            if (i){
-                                printf(",");
-                            }
-                            printf("%s",ft->name);
-                            i++;
-                        }
+    depth = 0;
+    while(depth>=0){
+        f = &walker.frames[depth];
+        lvl = walker.levels[depth];
+        if (f->i>=lvl->nindex || (opt.one && vars.total_matches)){
+#ifdef USE_URING
+            batch_flush();
+#endif
+            if (prefetch.depth == depth){
+                prefetch_drop();
+            }
+            close(f->fd);
+            depth--;
+            continue;
+        }
+        off = lvl->index[f->i++];
+        type = lvl->names.buf[off];
+        name = &lvl->names.buf[off+1];
+        dname = f->sep? walker.path.buf:NULL;
+
+        if (type == DT_UNKNOWN){
+            if (fstatat(f->fd,name,&statbuf,AT_SYMLINK_NOFOLLOW)<0){
+                fprintf(stderr,"%s: Can't stat '%s'\n",opt.self_name,path_join(dname,f->pathlen,name));
+                continue;
+            }
+            type = mode2dtype(statbuf.st_mode);
+        }
+        if (type == DT_LNK){
+            if (!opt.follow){
+                continue;
+            }
+            /* a dangling link is left to fail on open */
+            type = DT_REG;
+            if (fstatat(f->fd,name,&statbuf,0) == 0){
+                type = mode2dtype(statbuf.st_mode);
+            }
+            if (type == DT_DIR){
+                for(i=0;i<=depth;i++){
+                    if (walker.frames[i].dev == statbuf.st_dev && walker.frames[i].ino == statbuf.st_ino){
+                        break;
                     }
                 }
-                printf("%s",opt.line_end);
-            }else{
-                get_filetypes(&vars.file);
-                analize_file(&vars.file);
-                if (!opt.show_total && (opt.l || opt.c)){
-                    if (vars.file.nmatches){
-                        print_count(vars.file.fullname,vars.file.nmatches,opt.line_end,opt.c,opt.show_filename);
-                    }else if (opt.print_count0){
-                        print_count(vars.file.fullname,vars.file.nmatches,opt.line_end,1,opt.show_filename);
+                if (i<=depth){
+                    continue;
+                }
+            }
+        }
+        if (type == DT_DIR){
+            if (opt.recursive){
+#ifdef USE_URING
+                batch_flush();
+#endif
+                fd = openat(f->fd,name,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+                if (fd<0 || !path_set(f->pathlen,f->sep,name) || !walker_push(depth+1,fd,1)){
+                    fprintf(stderr, "%s: Failed to open directory %s: %s\n", opt.self_name,
+                            path_join(dname,f->pathlen,name),strerror(errno));
+                    if (fd>=0){
+                        close(fd);
                     }
+                    continue;
                 }
-           }
+                if (prefetch.depth == depth){
+                    prefetch_drop();
+                }
+                depth++;
+            }
+        }else if (G_filter(name)){
+            if (opt.prefetch && !batch_on()){
+                prefetch_fill(depth,f->i-1);
+                process_file_at(f->fd,dname,f->pathlen,name,prefetch_take(f->i-1));
+            }else{
+                batch_add(f->fd,dname,f->pathlen,name,type == DT_REG);
+            }
         }
-        FCLOSE(vars.file.f);
-    }else{
-        fprintf(stderr,"%s: %s: Failed to open %d:%s\n",opt.self_name,vars.file.fullname,errno,strerror(errno));
     }
-    vars.files_matched += vars.file.nmatches;
-    vars.total_matches += vars.file.nmatches;
-    return vars.file.nmatches;
-
+#ifdef USE_URING
+    batch_flush();
+#endif
 }
 
+#else
 
-void process(char *filename) {
+/* strips the trailing separator and makes the name of an entry of dirname */
+void make_fullname(char *fullname,char *dirname,char *name) {
+    strip_dirsep(dirname);
+    if(strcmp(dirname,".")){
+        snprintf(fullname,PATH_MAX-1,"%s" DIRSEPS "%s",dirname,name);
+    }else{
+        strcpy(fullname,name);
+    }
+    fullname[PATH_MAX-1] = 0;
+}
+
+void process_dir(char *dirname) {
     struct dirent** dents;
     char fullname[PATH_MAX];
     int count;
@@ -1655,62 +6953,53 @@ void process(char *filename) {
     int i;
     struct stat statbuf;
 
-    if (lstat(filename, &statbuf) < 0){
-        fprintf(stderr,"%s: Can't stat '%s'\n",opt.self_name,filename);
-        return;
-    }
-    if (S_ISDIR(statbuf.st_mode)){
-        count = scandir(filename,&dents, (opt.u) ? NULL : scandir_ignore_dir,opt.sort_files?alphasort:NULL);
-        if (count>=0){
-            i = strlen(filename);
-            if (i){
-                i--;
-            }
-            if(filename[i] == DIRSEPC){
-                filename[i] = 0;
-            }
-            for(i=0;(i<count) && !(opt.one && vars.total_matches) ;i++){
-                dent = dents[i];
+    count = scandir(dirname,&dents, (opt.u) ? NULL : scandir_ignore_dir,opt.sort_files?alphasort:NULL);
+    if (count>=0){
+        for(i=0;(i<count) && !(opt.one && vars.total_matches) ;i++){
+            dent = dents[i];
 
-                if (strcmp(dent->d_name, ".") != 0 && strcmp(dent->d_name, "..") != 0){
-                    if(strcmp(filename,".")){
-                        snprintf(fullname,sizeof(fullname)-1,"%s" DIRSEPS "%s",filename,dent->d_name);
-                    }else{
-                        strcpy(fullname,dent->d_name);
-                    }
-                    fullname[sizeof(fullname)-1] = 0;
-                    if (lstat(fullname, &statbuf) < 0){
-                        fprintf(stderr,"%s: Can't stat '%s'\n",opt.self_name,filename);
-                        return;
-                    }
+            if (strcmp(dent->d_name, ".") != 0 && strcmp(dent->d_name, "..") != 0){
+                make_fullname(fullname,dirname,dent->d_name);
+                if (lstat(fullname, &statbuf) < 0){
+                    fprintf(stderr,"%s: Can't stat '%s'\n",opt.self_name,dirname);
+                    return;
+                }
 #ifndef WINDOWS
-                    if (S_ISLNK(statbuf.st_mode) && !opt.follow){
-                        continue;
-                    }
+                if (S_ISLNK(statbuf.st_mode) && !opt.follow){
+                    continue;
+                }
 #endif
-                    if (S_ISDIR(statbuf.st_mode)){
-                        if(/*(opt.u || !ignore_dir(fullname)) &&*/ opt.recursive){
-                            process(fullname);
-                        }
-                    }else{
-                        if(opt.G.re){
-                            if (opt.invert_file_match == simple_match(&opt.G,dent->d_name,strlen(dent->d_name),NULL,1)){
-                                continue;
-                            }
-                        }
-                        process_file(fullname,dent->d_name);
+                if (S_ISDIR(statbuf.st_mode)){
+                    if(/*(opt.u || !ignore_dir(fullname)) &&*/ opt.recursive){
+                        process_dir(fullname);
                     }
+                }else if (G_filter(dent->d_name)){
+                    process_file(fullname,dent->d_name);
                 }
             }
-            while(count){
-                count--;
-                free(dents[count]);
-            }
-            free(dents);
-        }else{
-            fprintf(stderr, "%s: Failed to open directory %s: %s\n", opt.self_name,filename,
-                    strerror(errno));
         }
+        while(count){
+            count--;
+            free(dents[count]);
+        }
+        free(dents);
+    }else{
+        fprintf(stderr, "%s: Failed to open directory %s: %s\n", opt.self_name,dirname,
+                strerror(errno));
+    }
+}
+
+#endif
+
+void process(char *filename) {
+    struct stat statbuf;
+
+    if (lstat(filename, &statbuf) < 0){
+        fprintf(stderr,"%s: Can't stat '%s'\n",opt.self_name,filename);
+        return;
+    }
+    if (S_ISDIR(statbuf.st_mode)){
+        process_dir(filename);
     }else{
         process_file(filename,_basename(filename));
     }
@@ -2447,6 +7736,24 @@ option_t * type_opt_find(char *long_opt, char* short_opt,int len,void *options)
 }
 
 
+int opt_binary(opt_ctx_t *ctx) {
+    static const char *policies[] = {"text","skip","without-match",NULL};
+    int i;
+
+    if (0 == strcmp(ctx->data,"utf8")){
+        opt.binary_utf8 = 1;
+        return strlen(ctx->data);
+    }
+    for(i=0;policies[i];i++){
+        if (0 == strcmp(ctx->data,policies[i])){
+            *((int*)ctx->op->ptr) = i+BINARY_TEXT;
+            return strlen(ctx->data);
+        }
+    }
+    return -1;
+}
+
+
 int parse_colors(opt_ctx_t *ctx) {
     char *eptr;
     char *sptr;
@@ -2521,12 +7828,20 @@ option_t args[] = {
     {NULL,"passthru",OPT_NODATA, opt_set_true,&opt.passthru,0},
     {NULL,"output",OPT_DATA, opt_string,&opt.output,0},
     {NULL,"match",OPT_DATA, opt_string,&opt.match_pattern,0},
+    {NULL,"patterns-from",OPT_DATA, opt_string,&opt.patterns_from,0},
     {"m","max-count",OPT_DATA, opt_long,&opt.m,0},
     {"1",NULL,OPT_NODATA, opt_set_true,&opt.one,0},
     {"H","with-filename",OPT_NODATA, opt_set_true,&opt.H,0},
     {"h","without-filename",OPT_NODATA, opt_set_true,&opt.h,0},
     {"c","count",OPT_NODATA, opt_set_true,&opt.c,0},
+    {NULL,"count-matches",OPT_NODATA, opt_set_true,&opt.count_matches,0},
     {NULL,"column",OPT_NODATA, opt_set_true,&opt.column,0},
+    {NULL,"show-pattern",OPT_NODATA, opt_set_true,&opt.show_pattern,0},
+    {NULL,"line-number",OPT_NODATA, opt_set_true,&opt.line_number,0},
+    {NULL,"no-line-number",OPT_NODATA, opt_set_false,&opt.line_number,0},
+    {NULL,"binary",OPT_DATA, opt_binary,&opt.binary,0},
+    {"U","multiline",OPT_NODATA, opt_set_true,&opt.multiline,0},
+    {NULL,"multiline-dotall",OPT_NODATA, opt_set_true,&opt.multiline_dotall,0},
     {"A","after-context",OPT_DATA, opt_uint,&opt.A,0},
     {"B","before-context",OPT_DATA, opt_uint,&opt.B,0},
     {"C","context",OPT_OPT_DATA, opt_uint,&opt.C,(void*)2},
@@ -2553,6 +7868,14 @@ option_t args[] = {
     {"R",NULL,OPT_NODATA, opt_set_true,&opt.r,0},
     {NULL,"follow",OPT_NODATA, opt_set_true,&opt.follow,0},
     {NULL,"nofollow",OPT_NODATA, opt_set_false,&opt.follow,0},
+    {NULL,"mmap",OPT_NODATA, opt_set_true,&opt.mmap,0},
+    {NULL,"nommap",OPT_NODATA, opt_set_false,&opt.mmap,0},
+    {NULL,"uring",OPT_NODATA, opt_set_true,&opt.uring,0},
+    {NULL,"nouring",OPT_NODATA, opt_set_false,&opt.uring,0},
+    {NULL,"prefetch",OPT_DATA, opt_uint,&opt.prefetch,0},
+    {NULL,"whole-size",OPT_DATA, opt_uint,&opt.whole_size,0},
+    {"z","search-zip",OPT_NODATA, opt_set_true,&opt.z,0},
+    {NULL,"search-archives",OPT_NODATA, opt_set_true,&opt.archives,0},
     {NULL,"env",OPT_NODATA, opt_set_true,&opt.env,0},
     {NULL,"noenv",OPT_NODATA, opt_set_false,&opt.env,0},
     {NULL,"type",OPT_DATA,type_wanted,NULL,0},
@@ -2695,12 +8018,26 @@ void print_usage()
             "  --output=expr         Output the evaluation of expr for each line\n"
             "                        (turns off text highlighting)\n"
             "  --match PATTERN       Specify PATTERN explicitly.\n"
+            "  --patterns-from=FILE  Search for any of the patterns in FILE, one per\n"
+            "                        line.  No PATTERN argument is taken then.\n"
             "  -m, --max-count=NUM   Stop searching in each file after NUM matches\n"
             "  -1                    Stop searching after one match of any kind\n"
             "  -H, --with-filename   Print the filename for each match\n"
             "  -h, --no-filename     Suppress the prefixing filename on output\n"
             "  -c, --count           Show number of lines matching per file\n"
+            "  --count-matches       Show number of matches per file\n"
             "  --column              Show the column number of the first match\n"
+            "  --show-pattern        Show the line of the --patterns-from file with\n"
+            "                        the pattern that matched\n"
+            "  --[no-]line-number    Print the line number of each line (default: on)\n"
+            "  -U, --multiline       Let matches span lines, all the lines of a match\n"
+            "                        are printed\n"
+            "  --multiline-dotall    With -U, . matches newlines too\n"
+            "  --binary=POLICY       What to do with files holding NUL bytes: skip,\n"
+            "                        text or without-match.  By default a binary file\n"
+            "                        that matches is reported in one line.\n"
+            "                        --binary=utf8 takes invalid UTF-8 as binary too,\n"
+            "                        in a UTF-8 locale\n"
             "\n"
             "  -A NUM, --after-context=NUM\n"
             "                        Print NUM lines of trailing context after matching\n"
@@ -2751,6 +8088,10 @@ void print_usage()
             "  -r, -R, --recurse     Recurse into subdirectories (ack's default behavior)\n"
             "  -n, --no-recurse      No descending into subdirectories\n"
             "  -G REGEX              Only search files that match REGEX\n"
+            "  -z, --search-zip      Search the contents of gzip, bzip2, xz and zstd\n"
+            "                        compressed files.\n"
+            "  --search-archives     Search the members of tar (also compressed) and\n"
+            "                        zip archives, reported as ARCHIVE!MEMBER.\n"
             "\n"
             "  --perl                Include only Perl files.\n"
             "  --type=perl           Include only Perl files.\n"
@@ -2767,6 +8108,15 @@ void print_usage()
             "                        being of (the existing) type TYPE\n"
             "\n"
             "  --[no]follow          Follow symlinks.  Default is off.\n"
+            "  --[no]mmap            Map big regular files into memory instead of\n"
+            "                        reading them.  Default is on.\n"
+            "  --[no]uring           Open and read small files in batches with\n"
+            "                        io_uring where available.  Default is on.\n"
+            "  --prefetch=NUM        Ask the kernel to read NUM files ahead of the one\n"
+            "                        being searched, with io_uring the ones too big\n"
+            "                        for its batch reads.  Default is 0.\n"
+            "  --whole-size=NUM      Read files of up to NUM bytes that are not mapped\n"
+            "                        with a single read().  Default is " STR(SMALL_FILE_SIZE) ".\n"
             "\n"
             "  Directories ignored by default:\n");
 
@@ -2899,7 +8249,9 @@ void init_exts(){
 }
 
 void init_req_filetypes(){
+    static char *content_types[] = {"shell","xml","text","binary"};
     filetype_t *ft;
+    int i;
     opt.req_filetypes = bf_new(opt.nfiletypes);
 
     LIST_FOREACH(ft,&opt.all_filetypes,next){
@@ -2909,6 +8261,17 @@ void init_req_filetypes(){
             bf_set(opt.req_filetypes,ft->i);
         }
     }
+
+    /* the types analyse_internals() gives */
+    vars.by_content = 0;
+    for(i=0;interprets[i];i++){
+        ft = find_filetype(interprets[i]);
+        vars.by_content |= ft && bf_isset(opt.req_filetypes,ft->i);
+    }
+    for(i=0;i<numberof(content_types);i++){
+        ft = find_filetype(content_types[i]);
+        vars.by_content |= ft && bf_isset(opt.req_filetypes,ft->i);
+    }
 }
 
 int is_regexp(char * str, int len){
@@ -2917,6 +8280,38 @@ int is_regexp(char * str, int len){
     return (NULL != strpbrk(str,regexp_chars));
 }
 
+/*
+ * Can a match of the pattern be searched for in a block of lines?
+ * Assertions on the subject edges and negative lookarounds may see
+ * the neighbour lines there and miss a match found in a single line.
+ */
+int is_block_safe(char *str){
+    static char *unsafe[] = {"(?!","(?<!","\\A","\\z","\\Z","\\G","\\n",NULL};
+    /* a match taking the newline sees the next line where the line alone ends */
+    static char *eol[] = {"\\s","\\W","\\D","\\H","\\v","\\R","\\x","\\0","\\c","\\p","\\P","\\X","\\C",
+        "[^","[:^","(?s","space:","cntrl:","\n",NULL};
+    static char *end[] = {"$","\\b","\\B","(?=",NULL};
+    char **ptr;
+    char **ptr2;
+
+    for(ptr = unsafe;*ptr;ptr++){
+        if (strstr(str,*ptr)){
+            return 0;
+        }
+    }
+    for(ptr = eol;*ptr;ptr++){
+        if (strstr(str,*ptr)){
+            for(ptr2 = end;*ptr2;ptr2++){
+                if (strstr(str,*ptr2)){
+                    return 0;
+                }
+            }
+            break;
+        }
+    }
+    return 1;
+}
+
 int main(int argc, char *argv[]){
     char *locale=NULL;
     char *locale_from=NULL;
@@ -2943,6 +8338,10 @@ int main(int argc, char *argv[]){
     errors = 0;
     opt.r = true;
     opt.follow = 0;
+    opt.mmap = true;
+    opt.uring = true;
+    opt.whole_size = SMALL_FILE_SIZE;
+    opt.line_number = true;
     opt.a = 0;
     opt._break = !to_pipe;
     opt.heading = !to_pipe;
@@ -3037,7 +8436,7 @@ int main(int argc, char *argv[]){
 
 
             if (opt.L){
-                opt.l = opt.v = 1;
+                opt.l = 1;
             }
 
             if (opt.C){
@@ -3068,6 +8467,17 @@ int main(int argc, char *argv[]){
                 opt.m = 0;
             }
 
+            if (opt.prefetch<0){
+                fprintf(stderr,"%s: --prefetch may not be negative\n",opt.self_name);
+                errors++;
+                opt.prefetch = 0;
+            }
+            if (opt.whole_size<0){
+                fprintf(stderr,"%s: --whole-size may not be negative\n",opt.self_name);
+                errors++;
+                opt.whole_size = SMALL_FILE_SIZE;
+            }
+
             opt.show_filename = 1; // TODO if not a single file
 
             if (opt.l){
@@ -3081,6 +8491,10 @@ int main(int argc, char *argv[]){
             if (opt.H)
                 opt.show_filename = 1;
 
+            if (opt.count_matches){
+                opt.c = 1;
+            }
+
             if (opt.c){
                 opt.m = 0;
             }
@@ -3091,11 +8505,11 @@ int main(int argc, char *argv[]){
 
 
             if (opt.f /*|| opt.lines*/){
-                if (opt.match_pattern){
+                if (opt.match_pattern || opt.patterns_from){
                     errors++;
                     fprintf(stderr,"%s: Can't specify both a regex (%s) and use one of --line, -f or -g.\n",opt.self_name,opt.match_pattern);
                 }
-            }else{
+            }else if (!opt.patterns_from){
                 if (argc>nargc){
                     opt.match_pattern = argv[nargc];
                     nargc++;
@@ -3105,8 +8519,8 @@ int main(int argc, char *argv[]){
             if (opt.nopager){
                 opt.pager = NULL;
             }
-            vars.history = malloc(sizeof(buf_t)*(opt.B+1));
-            memset(vars.history,0,sizeof(buf_t)*(opt.B+1));
+            vars.history = malloc(sizeof(line_t)*(opt.B+1));
+            memset(vars.history,0,sizeof(line_t)*(opt.B+1));
             opt.print_count0 = (opt.c && !opt.l);
             opt.show_total = opt.c && !opt.show_filename;
             opt.show_context = !(opt.c || opt.l || opt.f);
@@ -3124,6 +8538,7 @@ int main(int argc, char *argv[]){
                 }
                 opt.show_filename = 0;
             }
+            opt.show_lineno = opt.show_filename && opt.line_number;
 
             if (locale == NULL){
                 locale = getenv("LC_ALL");
@@ -3140,17 +8555,29 @@ int main(int argc, char *argv[]){
                     fprintf(stderr, "%s: Failed to set locale %s (obtained from %s)\n",opt.self_name,locale, locale_from);
                     errors++;
                 }else{
+#ifdef USE_PCRE2
+                    pcretables = pcre2_maketables(NULL);
+#else
                     pcretables = pcre_maketables();
+#endif
                 }
             }
 
 
+            if (opt.patterns_from && !load_patterns(opt.patterns_from)){
+                errors++;
+            }
+
             {
                 char *ptr;
                 bool upper;
+                int i;
 
-                if (opt.smart_case && opt.match_pattern){
-                    ptr = opt.match_pattern;
+                for(i=0;opt.smart_case && i<(opt.patterns_from? patterns.n:1);i++){
+                    ptr = opt.patterns_from? patterns.list[i]:opt.match_pattern;
+                    if (!ptr){
+                        break;
+                    }
                     upper = isupper(*ptr);
                     while(*ptr){
                         if (upper != isupper(*ptr)){
@@ -3167,33 +8594,40 @@ int main(int argc, char *argv[]){
                 if (opt.i){
                     options |= PCRE_CASELESS;
                 }
+                if (opt.multiline && opt.multiline_dotall){
+                    options |= PCRE_DOTALL;
+                }
             }
 
-            if (opt.match_pattern){
-                if (opt.Q || opt.w){
+            lit_init();
+            if (!opt.patterns_from){
+                opt.show_pattern = 0;
+            }
+            if (opt.patterns_from){
+                if (!errors && !patterns_compile(&opt.match,options)){
+                    fprintf(stderr,"%s: Failed to compile the patterns from %s\n",opt.self_name,opt.patterns_from);
+                    errors++;
+                }
+            }else if (opt.match_pattern){
+                if (opt.Q || (opt.w && !is_regexp(opt.match_pattern,strlen(opt.match_pattern)))){
+                    /* plain strings go to the literal search */
+                    opt.match.literal = opt.Q;
+                    opt.match.word = opt.w;
+                }else if (opt.w){
                     char *tmp;
                     tmp = opt.match_pattern;
-                    opt.match_pattern = malloc(strlen(opt.match_pattern)+sizeof("\\b\\Q\\E\\b    "));
+                    opt.match_pattern = malloc(strlen(opt.match_pattern)+sizeof("\\b"));
                     if (!opt.match_pattern){
                         fprintf(stderr,"%s: "__FILE__":"STR(__LINE__)" OOM",opt.self_name);
                         errors++;
                     }else{
-                        opt.match_pattern[0] = 0;
-                        if (opt.w){
-                            strcat(opt.match_pattern,"\\b");
-                        }
-                        if (opt.Q){
-                            strcat(opt.match_pattern,"\\Q");
-                        }
+                        strcpy(opt.match_pattern,"\\b");
                         strcat(opt.match_pattern,tmp);
-                        if (opt.Q){
-                            strcat(opt.match_pattern,"\\E");
-                        }
                     }
 
                 }
                 if (opt.match_pattern){
-                    if(!compile(&opt.match,opt.match_pattern,options)){//|PCRE_FIRSTLINE|PCRE_MULTILINE))
+                    if(!compile(&opt.match,opt.match_pattern,options|PCRE_MULTILINE)){//|PCRE_FIRSTLINE|PCRE_MULTILINE))
                         fprintf(stderr,"%s: Failed to compile --match regex ('%s')\n",opt.self_name,opt.match_pattern);
                         errors++;
                     }
@@ -3210,11 +8644,23 @@ int main(int argc, char *argv[]){
                 }
             }
 
+            if (!errors){
+                vars.ctx = re_ctx_new(&opt.match);
+                vars.G_ctx = re_ctx_new(&opt.G);
+                if (!vars.ctx || !vars.G_ctx){
+                    fprintf(stderr,"%s: "__FILE__":"STR(__LINE__)" OOM\n",opt.self_name);
+                    errors++;
+                }
+            }
 
             if (!errors){
+                analize_select();
                 if (from_pipe){
                     process_sdtdin(FSTDIN_HANDLE);
                 }else{
+#ifdef USE_URING
+                    batch_init();
+#endif
                     if (nargc<argc){
                         char *ptr;
 
@@ -3226,6 +8672,13 @@ int main(int argc, char *argv[]){
                     }else{
                         process(".");
                     }
+#ifdef USE_URING
+                    batch_free();
+#endif
+#ifdef USE_GETDENTS
+                    prefetch_free();
+                    walker_free();
+#endif
                 }
 
 
@@ -3236,16 +8689,26 @@ int main(int argc, char *argv[]){
             {
                 long i;
                 for(i=0;i<opt.B+1;i++){
-                    free(vars.history[i].buf);
+                    free(vars.history[i].copy.buf);
                 }
                 free(vars.history);
             }
-            if (opt.Q || opt.w){
+            re_ctx_free(vars.ctx);
+            re_ctx_free(vars.G_ctx);
+            re_free(&opt.match);
+            re_free(&opt.G);
+            patterns_free();
+            if (opt.w && !opt.match.word){
                 free(opt.match_pattern);
             }
             bf_free(vars.filetypes);
             bf_free(opt.req_filetypes);
             free(vars.file.buf.buf);
+            free(vars.fullname.buf);
+#ifdef USE_ZIP
+            arc_free();
+            unzip_free();
+#endif
 
             times = time(NULL) - start_time;
 
@@ -3268,6 +8731,10 @@ int main(int argc, char *argv[]){
     //assert(malloced==0);
 #endif
 
+    if (opt.L){
+        /* -L succeeds when it lists a file */
+        return vars.files_listed? MATCH:NOMATCH;
+    }
     return (vars.files_matched != 0)?MATCH:NOMATCH;
 }
 
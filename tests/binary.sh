@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# binary detection: NUL bytes make a file binary, invalid UTF-8 only
+# with --binary=utf8
+#
+# usage: tests/binary.sh [ack]
+#
+
+ACK=${1:-./ack}
+LC_ALL=C.UTF-8
+export LC_ALL
+failed=0
+
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: $1: expected '$2', got '$3'"
+        failed=1
+    else
+        echo "ok: $1"
+    fi
+}
+
+# Latin-1 é before the match
+out=`printf 'caf\351 one\nfoo two\n' | $ACK foo`
+check "latin-1 is text" "foo two" "$out"
+
+out=`printf 'caf\351 one\nfoo two\n' | $ACK --binary=utf8 foo`
+case "$out" in
+    Binary*) out=binary ;;
+esac
+check "latin-1 with --binary=utf8" "binary" "$out"
+
+out=`printf 'caf\303\251 one\nfoo two\n' | $ACK --binary=utf8 foo`
+check "utf-8 with --binary=utf8" "foo two" "$out"
+
+out=`printf 'one\000\nfoo two\n' | $ACK foo`
+case "$out" in
+    Binary*) out=binary ;;
+esac
+check "NUL is binary" "binary" "$out"
+
+exit $failed